@@ -11,13 +11,9 @@
 #include<linux/pagemap.h>
 #include<linux/swap.h>
 #include "testfs.h"
+#include "testfs_trace.h"
 
 
-int testfs_permission(struct inode *inode, int mask)
-{
-	return generic_permission(inode, mask, NULL);
-}
-
 static inline void testfs_put_page(struct page *page)
 {
 	kunmap(page);
@@ -58,15 +54,6 @@ static unsigned testfs_last_byte_for_page(struct inode *inode,
  * Compares if directory entry
  * equals the supplies name
  */
-static inline int testfs_match(int len, const char *name , struct testfs_dir_entry *de)
-{
-	if (len != de->name_len)
-		return 0;
-	if (!de->inode)
-		return 0;
-	return !memcmp(name, de->name, len);
-}
-
 void testfs_set_inode_type(struct testfs_dir_entry *dentry, struct inode *inode)
 {
 	dentry->file_type = 0;
@@ -78,7 +65,8 @@ void testfs_set_inode_type(struct testfs_dir_entry *dentry, struct inode *inode)
 }
 
 /*
- * commit the changes made to a page on disk
+ * commit the changes made to a page. It is only written right away for
+ * DIRSYNC directories, otherwise it is left dirty for the writeback.
  */
 static int testfs_commit_chunk(struct page *page, loff_t pos, unsigned len)
 {
@@ -92,8 +80,12 @@ static int testfs_commit_chunk(struct page *page, loff_t pos, unsigned len)
 		i_size_write(dir, pos+len);
 		mark_inode_dirty(dir);
 	}
-	//unlock_page(page);
+	if (!IS_DIRSYNC(dir)) {
+		unlock_page(page);
+		return 0;
+	}
 	err = write_one_page(page,1);
+	testfs_stat_inc(dir->i_sb, TESTFS_STAT_SYNC_WRITES);
 	if (!err)
 	err = testfs_write_inode(dir,1);
 	return err;
@@ -115,12 +107,15 @@ int testfs_add_link(struct dentry *dentry, struct inode *inode)
 	int namelen = dentry->d_name.len;
 	int rec_len, name_len;
 	const char *name = dentry->d_name.name;
+	unsigned int scanned = 0;
+	ktime_t start = testfs_trace_start(testfs_add_link);
 
 	/*
-	 * Since we allow a file to grow only one blocksize max, assert here
-	 * Relax the assert if page size and blocksize are not same.
+	 * Since we allow a file to grow only one blocksize max, assert here.
+	 * With blocksize smaller than page size the whole directory is in the
+	 * first page, and with larger blocksize it spans multiple pages.
 	 */
-	BUG_ON(!(npages <= 1 || npages <= (dir->i_sb->s_blocksize/PAGE_CACHE_SIZE)));
+	BUG_ON(dir->i_size > dir->i_sb->s_blocksize);
 
 	/*
 	 * Now traverse through all the directory pages to see where we have
@@ -129,8 +124,10 @@ int testfs_add_link(struct dentry *dentry, struct inode *inode)
 	for (i=0; i<=npages; i++) {
 		char *dir_end;
 		page = testfs_get_page(dir, i);
-		if (IS_ERR(page))
+		if (IS_ERR(page)) {
+			err = PTR_ERR(page);
 			goto out;
+		}
 
 		/* Lock the page and get its address */
 		lock_page(page);
@@ -146,8 +143,12 @@ int testfs_add_link(struct dentry *dentry, struct inode *inode)
 		while ((char * )de <= kaddr) {
 			if ((char *)de == dir_end) {
 				/*
-				 * reached end of i_size
+				 * reached end of i_size. Directories can't grow
+				 * beyond a block, so there is no place left.
 				 */
+				err = -ENOSPC;
+				if (dir->i_size >= dir->i_sb->s_blocksize)
+					goto page_unlock;
 				name_len = 0;
 				rec_len = dir->i_sb->s_blocksize;
 				de->inode = 0;
@@ -155,6 +156,7 @@ int testfs_add_link(struct dentry *dentry, struct inode *inode)
 				goto gotit;
 			}
 			BUG_ON(de->rec_len == 0);
+			scanned++;
 			testfs_debug("Got \"%s\" : %u reclen = %d\n",de->name, de->inode, de->rec_len);
 			err = -EEXIST;
 			if (testfs_match(namelen, name, de))
@@ -185,7 +187,7 @@ int testfs_add_link(struct dentry *dentry, struct inode *inode)
 	BUG();
 	return -EINVAL;
 gotit:
-	pos = (page->index >> PAGE_CACHE_SHIFT) + (char *)de - (char *)page_address(page);
+	pos = page_offset(page) + (char *)de - (char *)page_address(page);
 	err = __testfs_write_begin(NULL, page->mapping, pos, rec_len, 0, &page, NULL);
 	if (err)
 		goto page_unlock;
@@ -202,18 +204,21 @@ gotit:
 	testfs_set_inode_type(de, inode);
 	testfs_debug("Creating new entry (ino = %u) (name_len = %d) (rec_len = %d) of type %d\n",de->inode, de->name_len, de->rec_len, de->file_type);
 	err = testfs_commit_chunk(page, pos, rec_len);
-	dir->i_mtime = dir->i_ctime = CURRENT_TIME_SEC;
+	dir->i_mtime = dir->i_ctime = CURRENT_TIME;
 	mark_inode_dirty(dir);
 page_put:
 	testfs_put_page(page);
 out:
+	trace_testfs_add_link(dir, &dentry->d_name, inode->i_ino, scanned, err,
+			testfs_elapsed_ns(start));
 	return err;
 page_unlock:
 	unlock_page(page);
 	goto page_put;
 }
 
-static int testfs_readdir(struct file *filep, void *dirent, filldir_t filldir)
+static int __testfs_readdir(struct file *filep, void *dirent, filldir_t filldir,
+		unsigned int *emitted)
 {
 	loff_t pos = filep->f_pos;
 	struct inode *inode = filep->f_path.dentry->d_inode;
@@ -262,6 +267,7 @@ static int testfs_readdir(struct file *filep, void *dirent, filldir_t filldir)
 					testfs_put_page(page);
 					return 0;
 				}
+				(*emitted)++;
 			}
 			filep->f_pos += de->rec_len;
 		}
@@ -270,16 +276,30 @@ static int testfs_readdir(struct file *filep, void *dirent, filldir_t filldir)
 	return 0;
 }
 
+static int testfs_readdir(struct file *filep, void *dirent, filldir_t filldir)
+{
+	struct inode *inode = filep->f_path.dentry->d_inode;
+	loff_t pos = filep->f_pos;
+	unsigned int emitted = 0;
+	ktime_t start = testfs_trace_start(testfs_readdir);
+	int err = __testfs_readdir(filep, dirent, filldir, &emitted);
+
+	trace_testfs_readdir(inode, pos, emitted, err, testfs_elapsed_ns(start));
+	return err;
+}
+
 struct testfs_dir_entry *testfs_find_dentry(struct inode *dir,
 		struct qstr *child, struct page **respage)
 {
-	struct testfs_dir_entry *de = NULL;
-	int n, pages = testfs_inode_pages(dir);
+	struct testfs_dir_entry *found = NULL;
+	int n, err, pages = testfs_inode_pages(dir);
 	struct page *page;
 	char *kaddr = NULL, *limit;
+	unsigned int scanned = 0;
+	ktime_t start = testfs_trace_start(testfs_find_dentry);
 
 	testfs_debug("Trying to find \"%s\" in dir ino (%u)\n",child->name, dir->i_ino);
-	for (n=0;n<=pages;n++) {
+	for (n=0;n<pages;n++) {
 		page = testfs_get_page(dir, n);
 		if (IS_ERR(page)) {
 			testfs_error("Error reading page# (%d) of inode %lu\n", n, dir->i_ino);
@@ -287,21 +307,77 @@ struct testfs_dir_entry *testfs_find_dentry(struct inode *dir,
 		}
 		kaddr = page_address(page);
 		limit = kaddr + testfs_last_byte_for_page(dir, n);
-		de = (struct testfs_dir_entry *)kaddr;
-		for (;(char *)de < limit ; de = (struct testfs_dir_entry *)((char *)de + de->rec_len)) {
-			if (!de->rec_len) {
-				testfs_error("Zero length rec_len for inode (%d) \"%s\"\n", de->inode, de->name);
-				testfs_put_page(page);
-				goto out;
-			}
-			if (testfs_match(child->len, child->name, de)) {
-				*respage = page;
-				return de;
-			}
+		err = testfs_search_dirents(kaddr, limit, child->name, child->len,
+				&found, &scanned);
+		if (!err) {
+			*respage = page;
+			goto out;
+		}
+		testfs_put_page(page);
+		if (err == -EIO) {
+			testfs_error("Broken rec_len chain in directory inode %lu\n", dir->i_ino);
+			goto out;
+		}
+	}
+out:
+	testfs_stat_inc(dir->i_sb, TESTFS_STAT_DENTRY_SEARCHES);
+	testfs_stat_add(dir->i_sb, TESTFS_STAT_DIRENTS_SCANNED, scanned);
+	trace_testfs_find_dentry(dir, child, found ? le32_to_cpu(found->inode) : 0,
+			scanned, testfs_elapsed_ns(start));
+	return found;
+}
+
+/*
+ * Lookup in a directory of a packed image. The image is read-only, so
+ * the entries are binary searched without locking the page.
+ */
+static unsigned int testfs_packed_find(struct inode *dir, struct qstr *child)
+{
+	struct testfs_dir_entry *de;
+	struct page *page;
+	unsigned int lo = TESTFS_PACKED_FIRST_DIRENT, hi, mid;
+	unsigned int ino = 0, scanned = 0;
+	ktime_t start = testfs_trace_start(testfs_find_dentry);
+	int cmp;
+
+	/* Directories are a block, which is in the first page */
+	hi = min_t(loff_t, dir->i_size, PAGE_CACHE_SIZE) / sizeof(*de);
+	page = testfs_get_page(dir, 0);
+	if (IS_ERR(page)) {
+		testfs_error("Error reading page# (0) of inode %lu\n", dir->i_ino);
+		goto out;
+	}
+	de = (struct testfs_dir_entry *)page_address(page);
+
+	/* "." and ".." aren't part of the sorted entries */
+	for (mid = 0; mid < lo && mid < hi; mid++) {
+		scanned++;
+		if (testfs_match(child->len, child->name, de + mid)) {
+			ino = le32_to_cpu(de[mid].inode);
+			goto found;
+		}
+	}
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		scanned++;
+		cmp = testfs_namecmp(child->name, child->len, de[mid].name,
+				min_t(__u32, le32_to_cpu(de[mid].name_len), TESTFS_MAX_NAME_LEN));
+		if (!cmp) {
+			ino = le32_to_cpu(de[mid].inode);
+			break;
 		}
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
 	}
+found:
+	testfs_put_page(page);
 out:
-	return NULL;
+	testfs_stat_inc(dir->i_sb, TESTFS_STAT_DENTRY_SEARCHES);
+	testfs_stat_add(dir->i_sb, TESTFS_STAT_DIRENTS_SCANNED, scanned);
+	trace_testfs_find_dentry(dir, child, ino, scanned, testfs_elapsed_ns(start));
+	return ino;
 }
 
 /*
@@ -313,6 +389,9 @@ unsigned int testfs_inode_by_name(struct inode *dir, struct qstr *child)
 	unsigned ino = 0;
 	struct testfs_dir_entry *dentry;
 	struct page *page;
+
+	if (testfs_has_feature(dir->i_sb, PACKED))
+		return testfs_packed_find(dir, child);
 	dentry = testfs_find_dentry(dir, child, &page);
 	if (dentry && !(IS_ERR(dentry))) {
 		ino = le32_to_cpu(dentry->inode);
@@ -330,13 +409,14 @@ int testfs_delete_entry (struct testfs_dir_entry *dir, struct page *page)
 	struct inode *inode = mapping->host;
 	int pos, from = (((char *)dir) - kaddr) & ~(inode->i_sb->s_blocksize - 1);
 	int to = (((char *)dir) - kaddr) + calc_reclen_from_len(dir->name_len);
-	old = cur= (struct testfs_dir_entry *)kaddr;
+	/* Entries don't span blocks, so start from the block holding the entry */
+	old = cur= (struct testfs_dir_entry *)(kaddr + from);
 	testfs_debug("here\n");
 	for (;cur < dir;cur= (struct testfs_dir_entry *)((char *)cur+ cur->rec_len)) {
 		testfs_debug("ino (%lu - %s)\n",cur->inode, cur->name);
 		old = cur;
 	}
-	if ((char *)cur!= kaddr) {
+	if ((char *)cur!= kaddr + from) {
 		/* This is not the first entry on page */
 		old->rec_len += cur->rec_len;
 		cur->inode = 0;
@@ -349,6 +429,9 @@ int testfs_delete_entry (struct testfs_dir_entry *dir, struct page *page)
 	err = testfs_commit_chunk(page, pos, to - from);
 	mark_inode_dirty(inode);
 	testfs_put_page(page);
+	/* The removed inode can't be freed before the block is written */
+	if (!IS_DIRSYNC(inode))
+		testfs_orphan_dir(inode);
 	return err;
 }
 
@@ -356,4 +439,6 @@ const struct file_operations testfs_dir_operations = {
 	.llseek = generic_file_llseek,
 	.read = generic_read_dir,
 	.readdir = testfs_readdir,
+	.unlocked_ioctl = testfs_ioctl,
+	.fsync = simple_fsync,
 };
@@ -12,7 +12,6 @@
 const struct inode_operations testfs_file_inode_operations = {
 	.truncate = testfs_truncate,
 	.setattr  = testfs_setattr,
-	.permission = testfs_permission,
 };
 
 const struct file_operations testfs_file_operations = {
@@ -21,4 +20,10 @@ const struct file_operations testfs_file_operations = {
 	.aio_read = generic_file_aio_read,
 	.aio_write = generic_file_aio_write,
 	.open = generic_file_open,
+	.unlocked_ioctl = testfs_ioctl,
+	/* The VFS writes the pages, this writes the inode with testfs_write_inode() */
+	.fsync = simple_fsync,
+	/* Lets splice() move data through a pipe from page cache to page cache */
+	.splice_read = generic_file_splice_read,
+	.splice_write = generic_file_splice_write,
 };
@@ -0,0 +1,182 @@
+/***********************************************************/
+/*  This is the readme for the testfs filesystem           */
+/*  Author : Manish Katiyar <mkatiyar@gmail.com>           */
+/*  Description : A simple disk based filesystem for linux */
+/*  Date   : 08/01/09                                      */
+/*  Version : 0.01                                         */
+/*  Distributed under GPL                                  */
+/***********************************************************/
+
+/*
+ * On disk format code shared by the kernel module and the userspace tools,
+ * which get it through util/libtestfs.a. Everything here works on plain
+ * buffers, so it must not use anything the kernel and libc don't both have.
+ */
+#ifdef __KERNEL__
+#include<linux/fs.h>
+#include<linux/string.h>
+#include<linux/errno.h>
+#else
+#include<string.h>
+#include<errno.h>
+#include<sys/stat.h>
+#endif
+#include "testfs.h"
+
+/*
+ * Where the raw inode ino lives : the inode table block and the offset
+ * of the inode in it. Inodes don't span blocks.
+ */
+int testfs_inode_location(struct testfs_super_block *ts, unsigned int ino,
+		unsigned int *block, unsigned int *offset)
+{
+	unsigned int inodes_per_block = ts->s_blocksize/sizeof(struct testfs_inode);
+	unsigned int slot = ino - ts->s_first_nonmeta_inode;
+
+	if (ino < ts->s_first_nonmeta_inode || slot/inodes_per_block >= TESTFS_ITABLE_BLOCKS(ts))
+		return -EINVAL;
+	*block = TESTFS_INODE_TABLE_BLOCK + slot/inodes_per_block;
+	*offset = (slot%inodes_per_block)*sizeof(struct testfs_inode);
+	return 0;
+}
+
+/*
+ * First inode which is free both in the bitmap and in busy (blocks still
+ * being discarded, may be NULL), looking from byte first/8 upto max.
+ * Returns 0 if there is none. The number of bitmap bytes looked at is
+ * returned in scanned.
+ */
+unsigned int testfs_find_free_bit(const unsigned char *bitmap, const unsigned char *busy,
+		unsigned int first, unsigned int max, unsigned int *scanned)
+{
+	unsigned int n = first/8;
+	int i;
+
+	for (; n*8 < max; n++) {
+		unsigned char used = bitmap[n] | (busy ? busy[n] : 0);
+		if (used == 0xff)
+			continue;
+		for (i = 0; i < 8; i++)
+			if (!(used & (1 << i))) {
+				*scanned = n - first/8 + 1;
+				return n*8 + i < max ? n*8 + i : 0;
+			}
+	}
+	*scanned = n - first/8;
+	return 0;
+}
+
+/*
+ * Look for name in the dirents from start upto end, where the directory
+ * ends within the buffer. Returns 0 and the entry in res if found, -ENOENT
+ * if not and -EIO if the rec_len chain is broken. The number of entries
+ * looked at is added to scanned.
+ */
+int testfs_search_dirents(char *start, char *end, const char *name, unsigned int len,
+		struct testfs_dir_entry **res, unsigned int *scanned)
+{
+	struct testfs_dir_entry *de = (struct testfs_dir_entry *)start;
+
+	for (; (char *)de < end; de = (struct testfs_dir_entry *)((char *)de + de->rec_len)) {
+		if (!de->rec_len || de->rec_len > end - (char *)de)
+			return -EIO;
+		(*scanned)++;
+		if (testfs_match(len, name, de)) {
+			*res = de;
+			return 0;
+		}
+	}
+	return -ENOENT;
+}
+
+/*
+ * Set up a new directory block with "." and "..", the way mktestfs does
+ * it for the root and mkdir for other directories.
+ */
+void testfs_init_dirblock(char *block, unsigned int blocksize, unsigned int ino,
+		unsigned int parent)
+{
+	struct testfs_dir_entry *de = (struct testfs_dir_entry *)block;
+
+	memset(block, 0, blocksize);
+	de->inode = ino;
+	de->name_len = 1;
+	de->file_type = S_IFDIR;
+	memcpy(de->name, ".", 1);
+	de->rec_len = calc_rec_len(de);
+
+	de = (struct testfs_dir_entry *)(block + de->rec_len);
+	de->inode = parent;
+	de->name_len = 2;
+	de->file_type = S_IFDIR;
+	memcpy(de->name, "..", 2);
+	de->rec_len = blocksize - calc_reclen_from_len(1);
+}
+
+/*
+ * Add name to a directory block, in the first unused entry which is big
+ * enough or else by splitting the first entry with enough slack after its
+ * name. Returns -EEXIST if the name is there already and -ENOSPC if the
+ * block is full.
+ */
+int testfs_add_dirent(char *block, unsigned int blocksize, const char *name,
+		unsigned int len, unsigned int ino, unsigned int file_type)
+{
+	struct testfs_dir_entry *de = (struct testfs_dir_entry *)block, *de1;
+	unsigned int reclen = calc_reclen_from_len(len);
+	char *end = block + blocksize;
+
+	for (; (char *)de < end; de = (struct testfs_dir_entry *)((char *)de + de->rec_len)) {
+		if (!de->rec_len || de->rec_len > end - (char *)de)
+			return -EIO;
+		if (testfs_match(len, name, de))
+			return -EEXIST;
+	}
+	for (de = (struct testfs_dir_entry *)block; (char *)de < end;
+			de = (struct testfs_dir_entry *)((char *)de + de->rec_len)) {
+		unsigned int used = calc_reclen_from_len(de->name_len);
+		if (!de->inode && de->rec_len >= reclen)
+			goto gotit;
+		if (de->inode && de->rec_len >= used + reclen) {
+			de1 = (struct testfs_dir_entry *)((char *)de + used);
+			de1->rec_len = de->rec_len - used;
+			de->rec_len = used;
+			de = de1;
+			goto gotit;
+		}
+	}
+	return -ENOSPC;
+gotit:
+	de->inode = ino;
+	de->name_len = len;
+	de->file_type = file_type;
+	memcpy(de->name, name, len);
+	return 0;
+}
+
+/*
+ * Remove name from a directory block. Its space goes to the entry before
+ * it, like testfs_delete_entry() does. Returns the inode the entry
+ * pointed to, or 0 if there is no such entry.
+ */
+unsigned int testfs_remove_dirent(char *block, unsigned int blocksize, const char *name,
+		unsigned int len)
+{
+	struct testfs_dir_entry *de = (struct testfs_dir_entry *)block, *prev = NULL;
+	char *end = block + blocksize;
+	unsigned int ino;
+
+	for (; (char *)de < end; prev = de,
+			de = (struct testfs_dir_entry *)((char *)de + de->rec_len)) {
+		if (!de->rec_len || de->rec_len > end - (char *)de)
+			return 0;
+		if (!testfs_match(len, name, de))
+			continue;
+		ino = de->inode;
+		if (prev)
+			prev->rec_len += de->rec_len;
+		de->inode = 0;
+		return ino;
+	}
+	return 0;
+}
@@ -8,10 +8,11 @@
 /***********************************************************/
 #include<linux/vfs.h>
 #include<linux/sched.h> /* For using "current" variable */
+#include<linux/cred.h>
 #include<linux/fs.h>
 #include<linux/buffer_head.h>
 #include "testfs.h"
-#define TESTFS_INODE_BM_BLOCK 2 /* Inode bitmap block number */
+#include "testfs_trace.h"
 
 /*
  * In memory states of testfs inode
@@ -36,7 +37,7 @@ read_inode_bitmap(struct super_block *sb)
 {
 	struct testfs_sb_info *sbi = TESTFS_SB(sb);
 	if(!sbi->inode_bitmap) {
-		sbi->inode_bitmap = sb_bread(sb, get_testfs_inode_bitmap());
+		sbi->inode_bitmap = testfs_meta_bread(sb, get_testfs_inode_bitmap());
 	}
 	BUG_ON(!sbi->inode_bitmap);
 	return sbi->inode_bitmap;
@@ -92,58 +93,358 @@ static void testfs_release_inode(struct super_block *sb)
 }
 
 /*
- * Free an inode from the filesystem
+ * Returns true if the bit is set in either the inode bitmap or the map of
+ * blocks waiting to be discarded. Since inodes and blocks have 1:1
+ * correspondence both maps are indexed by the same number.
  */
-void testfs_free_inode(struct inode *inode)
+static inline int testfs_block_busy(char *bitmap, char *discard_map, unsigned int ino)
+{
+	return !inode_already_freed(bitmap, ino) || !inode_already_freed(discard_map, ino);
+}
+
+/*
+ * Discard the blocks which were freed since the last run. Blocks stay marked
+ * in s_discard_map till their discard is done so that they are not reused
+ * in between.
+ */
+void testfs_discard_pending(struct super_block *sb)
+{
+	struct testfs_sb_info *tsbi = TESTFS_SB(sb);
+	char *map = tsbi->s_discard_map;
+	unsigned int blk, start, i;
+	int err = 0;
+
+	mutex_lock(&tsbi->s_discard_mutex);
+	spin_lock(&tsbi->s_alloc_lock);
+	for (blk = tsbi->s_first_nonmeta_inode; blk < tsbi->s_max_inodes; ) {
+		if (inode_already_freed(map, blk)) {
+			blk++;
+			continue;
+		}
+		/* Coalesce the neighbouring freed blocks into a single discard */
+		start = blk;
+		while (blk < tsbi->s_max_inodes && !inode_already_freed(map, blk))
+			blk++;
+		spin_unlock(&tsbi->s_alloc_lock);
+		if (!err)
+			err = sb_issue_discard(sb, start, blk - start);
+		spin_lock(&tsbi->s_alloc_lock);
+		for (i = start; i < blk; i++)
+			testfs_clear_inode_bit(map, i);
+	}
+	spin_unlock(&tsbi->s_alloc_lock);
+	mutex_unlock(&tsbi->s_discard_mutex);
+
+	if (err == -EOPNOTSUPP) {
+		printk(KERN_WARNING "TESTFS: discard not supported by device, disabling\n");
+		clear_opt(tsbi->s_mount_opt, DISCARD);
+	} else if (err)
+		testfs_error("Discard of freed blocks failed with %d\n", err);
+}
+
+void testfs_discard_work(struct work_struct *work)
+{
+	struct testfs_sb_info *tsbi = container_of(work, struct testfs_sb_info,
+						s_discard_work.work);
+	testfs_discard_pending(tsbi->s_sb);
+}
+
+/*
+ * Discard all the free blocks in the given range (FITRIM). On return
+ * range->len holds the number of bytes discarded.
+ */
+int testfs_trim_fs(struct super_block *sb, struct fstrim_range *range)
+{
+	struct testfs_sb_info *tsbi = TESTFS_SB(sb);
+	unsigned int blkbits = sb->s_blocksize_bits;
+	char *map = tsbi->s_discard_map;
+	char *bitmap = read_inode_bitmap(sb)->b_data;
+	u64 first = range->start >> blkbits;
+	u64 last = first + (range->len >> blkbits);
+	u64 minlen = range->minlen >> blkbits;
+	unsigned int blk, start, i;
+	u64 trimmed = 0;
+	int err = 0;
+
+	/* Only the data blocks can be discarded */
+	if (first <= tsbi->s_first_nonmeta_inode)
+		first = tsbi->s_first_nonmeta_inode + 1;
+	if (last > tsbi->s_max_inodes)
+		last = tsbi->s_max_inodes;
+	if (!minlen)
+		minlen = 1;
+	range->len = 0;
+	if (first >= last)
+		return 0;
+
+	mutex_lock(&tsbi->s_discard_mutex);
+	spin_lock(&tsbi->s_alloc_lock);
+	for (blk = first; blk < last; ) {
+		if (testfs_block_busy(bitmap, map, blk)) {
+			blk++;
+			continue;
+		}
+		start = blk;
+		while (blk < last && !testfs_block_busy(bitmap, map, blk))
+			blk++;
+		if (blk - start < minlen)
+			continue;
+
+		/* Keep the allocator away while the range is being discarded */
+		for (i = start; i < blk; i++)
+			testfs_set_inode_bit(map, i);
+		spin_unlock(&tsbi->s_alloc_lock);
+		err = sb_issue_discard(sb, start, blk - start);
+		spin_lock(&tsbi->s_alloc_lock);
+		for (i = start; i < blk; i++)
+			testfs_clear_inode_bit(map, i);
+		if (err)
+			break;
+		trimmed += blk - start;
+		if (fatal_signal_pending(current)) {
+			err = -EINTR;
+			break;
+		}
+	}
+	spin_unlock(&tsbi->s_alloc_lock);
+	mutex_unlock(&tsbi->s_discard_mutex);
+
+	range->len = trimmed << blkbits;
+	return err;
+}
+
+/*
+ * Free an inode and its block in the bitmap. Called with s_orphan_mutex
+ * held, the caller writes out the bitmap.
+ */
+static void testfs_free_inode(struct super_block *sb, unsigned int ino, unsigned int block)
+{
+	struct testfs_sb_info *tsbi = TESTFS_SB(sb);
+	char *bitmap = read_inode_bitmap(sb)->b_data;
+
+	testfs_debug("Freeing inode %u\n",ino);
+	trace_testfs_free_inode(sb, ino, block);
+	spin_lock(&tsbi->s_alloc_lock);
+	if (inode_already_freed(bitmap, ino)) {
+		spin_unlock(&tsbi->s_alloc_lock);
+		testfs_error("Inode already free %u\n",ino);
+		return;
+	}
+	testfs_clear_inode_bit(bitmap, ino);
+	testfs_release_inode(sb);
+	/* Let the device know about the freed block in the next discard batch */
+	if (test_opt(sb, DISCARD) && block)
+		testfs_set_inode_bit(tsbi->s_discard_map, block);
+	spin_unlock(&tsbi->s_alloc_lock);
+}
+
+/*
+ * Returns true if ino is allocated in the bitmap
+ */
+int testfs_inode_in_use(struct super_block *sb, unsigned int ino)
+{
+	struct testfs_sb_info *tsbi = TESTFS_SB(sb);
+	char *bitmap = read_inode_bitmap(sb)->b_data;
+	int used;
+
+	spin_lock(&tsbi->s_alloc_lock);
+	used = !inode_already_freed(bitmap, ino);
+	spin_unlock(&tsbi->s_alloc_lock);
+	return used;
+}
+
+/*
+ * Put an unlinked inode on the orphan list. Nothing is written here, the
+ * inode buffer with its nlinks of 0 is left dirty by testfs_delete_inode()
+ * and the inode is freed with the next batch of testfs_release_orphans().
+ * If we crash before that the inode is leaked till fsck frees it.
+ */
+void testfs_orphan_add(struct inode *inode)
 {
-	struct buffer_head *bitmap_bh = NULL;
 	struct super_block *sb = inode->i_sb;
-	struct testfs_super_block *tsb = TESTFS_SB(sb)->s_ts;
+	struct testfs_sb_info *tsbi = TESTFS_SB(sb);
 	unsigned int ino = inode->i_ino;
 
-	BUG_ON(!tsb);
-	testfs_debug("Freeing inode %u\n",ino);
-	if (ino <= tsb->s_first_nonmeta_inode || ino >= tsb->s_max_inodes) {
+	if (ino <= tsbi->s_first_nonmeta_inode || ino >= tsbi->s_max_inodes) {
 		testfs_error("Invalid inode number to be freed %u\n",ino);
-		goto error_return;
+		return;
+	}
+	mutex_lock(&tsbi->s_orphan_mutex);
+	if (!inode_already_freed(tsbi->s_orphan_map, ino)) {
+		mutex_unlock(&tsbi->s_orphan_mutex);
+		testfs_error("Inode %u already on the orphan list\n",ino);
+		return;
+	}
+	testfs_set_inode_bit(tsbi->s_orphan_map, ino);
+	tsbi->s_nr_orphans++;
+	mutex_unlock(&tsbi->s_orphan_mutex);
+	testfs_stat_inc(sb, TESTFS_STAT_ORPHANS);
+	schedule_delayed_work(&tsbi->s_orphan_work, TESTFS_ORPHAN_DELAY);
+}
+
+/*
+ * An entry was removed from dir without writing the directory block.
+ * It has to be on disk before the inode it named is freed.
+ */
+void testfs_orphan_dir(struct inode *dir)
+{
+	struct testfs_sb_info *tsbi = TESTFS_SB(dir->i_sb);
+
+	spin_lock(&tsbi->s_alloc_lock);
+	testfs_set_inode_bit(tsbi->s_orphan_dirs, dir->i_ino);
+	spin_unlock(&tsbi->s_alloc_lock);
+}
+
+/*
+ * Write the directories entries were removed from since the last batch.
+ * A directory which isn't in the inode cache any more had its pages
+ * written before it was evicted.
+ */
+static void testfs_write_orphan_dirs(struct super_block *sb)
+{
+	struct testfs_sb_info *tsbi = TESTFS_SB(sb);
+	struct inode *dir;
+	unsigned int ino;
+	int removed;
+
+	for (ino = tsbi->s_first_nonmeta_inode; ino < tsbi->s_max_inodes; ino++) {
+		if (inode_already_freed(tsbi->s_orphan_dirs, ino))
+			continue;
+		spin_lock(&tsbi->s_alloc_lock);
+		removed = !inode_already_freed(tsbi->s_orphan_dirs, ino);
+		testfs_clear_inode_bit(tsbi->s_orphan_dirs, ino);
+		spin_unlock(&tsbi->s_alloc_lock);
+		if (!removed)
+			continue;
+		dir = ilookup(sb, ino);
+		if (!dir)
+			continue;
+		filemap_write_and_wait(dir->i_mapping);
+		testfs_stat_inc(sb, TESTFS_STAT_SYNC_WRITES);
+		iput(dir);
+	}
+}
+
+/*
+ * Free all the inodes on the orphan list with a single write of the
+ * bitmap. The directory blocks their entries were removed from are
+ * written first, so that no entry on disk ever names a free inode.
+ *
+ * A list left in the superblock (by a crash with testfs-fuse, which
+ * keeps files unlinked while open there) is dropped before any of its
+ * inodes is freed: a crash in between leaks them rather than freeing an
+ * inode which got reused.
+ */
+void testfs_release_orphans(struct super_block *sb)
+{
+	struct testfs_sb_info *tsbi = TESTFS_SB(sb);
+	struct buffer_head *bitmap_bh, *bh;
+	struct testfs_inode *raw;
+	unsigned int ino, block;
+
+	/* Not under s_orphan_mutex, the iput() of a directory may add an orphan */
+	testfs_write_orphan_dirs(sb);
+
+	mutex_lock(&tsbi->s_orphan_mutex);
+	if (!tsbi->s_nr_orphans && !tsbi->s_ts->s_last_orphan)
+		goto out;
+	if (tsbi->s_ts->s_last_orphan) {
+		tsbi->s_ts->s_last_orphan = 0;
+		mark_buffer_dirty(tsbi->s_bh);
+		sync_dirty_buffer(tsbi->s_bh);
+		testfs_stat_inc(sb, TESTFS_STAT_SYNC_WRITES);
 	}
-	clear_inode(inode);
+
 	bitmap_bh = read_inode_bitmap(sb);
-	if (inode_already_freed(bitmap_bh->b_data, ino)) {
-		testfs_error("Inode already free %u\n",ino);
-		goto error_return;
+	for (ino = tsbi->s_first_nonmeta_inode + 1;
+			tsbi->s_nr_orphans && ino < tsbi->s_max_inodes; ino++) {
+		if (inode_already_freed(tsbi->s_orphan_map, ino))
+			continue;
+		block = ino;
+		raw = testfs_get_inode(sb, ino, &bh);
+		if (raw) {
+			block = le32_to_cpu(raw->data[0]);
+			raw->next_orphan = 0;
+			raw->type = 0;
+			mark_buffer_dirty(bh);
+			brelse(bh);
+		}
+		testfs_free_inode(sb, ino, block);
+		testfs_clear_inode_bit(tsbi->s_orphan_map, ino);
+		tsbi->s_nr_orphans--;
 	}
-	testfs_clear_inode_bit(bitmap_bh->b_data, ino);
-	testfs_release_inode(sb);
 	mark_buffer_dirty(bitmap_bh);
-error_return:
-	return;
+	sync_dirty_buffer(bitmap_bh);
+	testfs_stat_inc(sb, TESTFS_STAT_SYNC_WRITES);
+	testfs_stat_inc(sb, TESTFS_STAT_ORPHAN_BATCHES);
+	if (test_opt(sb, DISCARD))
+		schedule_delayed_work(&tsbi->s_discard_work, TESTFS_DISCARD_DELAY);
+out:
+	mutex_unlock(&tsbi->s_orphan_mutex);
 }
 
-static unsigned int testfs_find_free_inode(unsigned char *bitmap, struct super_block *sb)
+void testfs_orphan_work(struct work_struct *work)
+{
+	struct testfs_sb_info *tsbi = container_of(work, struct testfs_sb_info,
+						s_orphan_work.work);
+	testfs_release_orphans(tsbi->s_sb);
+}
+
+/*
+ * Free the inodes which were left on the orphan list by a crash.
+ * Called at mount time.
+ */
+void testfs_orphan_cleanup(struct super_block *sb)
 {
 	struct testfs_sb_info *tsbi = TESTFS_SB(sb);
-	unsigned char *end = bitmap + sb->s_blocksize;
-	unsigned int ino = 0;
-	unsigned char *start = bitmap + (tsbi->s_first_nonmeta_inode)/8;
+	char *bitmap = read_inode_bitmap(sb)->b_data;
+	unsigned int ino = le32_to_cpu(tsbi->s_ts->s_last_orphan);
+	unsigned int next, n, nr = 0;
+	struct buffer_head *bh;
+	struct testfs_inode *raw;
+
+	mutex_lock(&tsbi->s_orphan_mutex);
+	/* Don't trust the list, it may point anywhere or loop */
+	for (n = 0; ino && n < tsbi->s_max_inodes; n++, ino = next) {
+		if (ino <= tsbi->s_first_nonmeta_inode || ino >= tsbi->s_max_inodes ||
+				!inode_already_freed(tsbi->s_orphan_map, ino)) {
+			testfs_error("Bad inode %u on the orphan list\n", ino);
+			break;
+		}
+		raw = testfs_get_inode(sb, ino, &bh);
+		if (!raw)
+			break;
+		next = le32_to_cpu(raw->next_orphan);
+		if (!raw->nlinks && !inode_already_freed(bitmap, ino)) {
+			testfs_set_inode_bit(tsbi->s_orphan_map, ino);
+			tsbi->s_nr_orphans++;
+			nr++;
+		}
+		brelse(bh);
+	}
+	mutex_unlock(&tsbi->s_orphan_mutex);
+
+	if (nr)
+		printk(KERN_INFO "TESTFS: %s: freeing %u orphaned inodes\n", sb->s_id, nr);
+	testfs_release_orphans(sb);
+}
+
+/*
+ * Called with s_alloc_lock held. The number of bitmap bytes looked
+ * at is returned in scanned.
+ */
+static unsigned int testfs_find_free_inode(unsigned char *bitmap, struct super_block *sb,
+		unsigned int *scanned)
+{
+	struct testfs_sb_info *tsbi = TESTFS_SB(sb);
+
 	/*
 	 * A quick and dirty way to find the free inode
-	 * in filesystem. Just loop over all the inodes
+	 * in filesystem. Just loop over all the inodes.
+	 * Blocks which are still being discarded are skipped.
 	 */
-	while (start <= end) {
-		int i;
-		if (*start == 0xff) {
-		       start++;
-		       continue;	       
-		}
-		for(i=0;i<8;i++)
-			if (!((*start)&(1<<i))) {
-				ino = ((int)(start-bitmap))*8 + i;
-				return ino;
-			}
-	
-	}
-	return ino;
+	return testfs_find_free_bit(bitmap, (unsigned char *)tsbi->s_discard_map,
+			tsbi->s_first_nonmeta_inode, tsbi->s_max_inodes, scanned);
 }
 
 struct inode *testfs_new_inode(struct inode *dir, int mode)
@@ -152,8 +453,13 @@ struct inode *testfs_new_inode(struct inode *dir, int mode)
 	struct testfs_sb_info *tsbi = TESTFS_SB(sb);
 	struct testfs_inode_info *tsi;
 	struct buffer_head *bitmap_bh = NULL;
+	struct buffer_head *bh;
+	struct testfs_inode *raw;
 	struct inode *inode;
 	unsigned int ino = 0;
+	unsigned int scanned = 0;
+	int retried = 0;
+	ktime_t start = testfs_trace_start(testfs_new_inode);
 
 	inode = new_inode(sb);
 	if(!inode)
@@ -164,30 +470,67 @@ struct inode *testfs_new_inode(struct inode *dir, int mode)
 	tsi = TESTFS_I(inode);
 
 	bitmap_bh = read_inode_bitmap(sb);
-	ino = testfs_find_free_inode(bitmap_bh->b_data, sb);
+retry:
+	spin_lock(&tsbi->s_alloc_lock);
+	ino = testfs_find_free_inode(bitmap_bh->b_data, sb, &scanned);
 	if(!ino)
 	{
+		spin_unlock(&tsbi->s_alloc_lock);
+		/* Unlinked inodes may be waiting for the orphan worker */
+		if (tsbi->s_nr_orphans && !retried) {
+			retried = 1;
+			testfs_release_orphans(sb);
+			goto retry;
+		}
 		testfs_debug("Could not find any free inode. File system full\n");
+		iput(inode);
+		trace_testfs_new_inode(dir, 0, mode, scanned, testfs_elapsed_ns(start));
 		return ERR_PTR(-ENOSPC);
 	}
 	testfs_debug("Allocated new inode (%u)\n",ino);
 	testfs_set_inode_bit(bitmap_bh->b_data, ino);
+	tsbi->s_free_inodes--;
+	inode->i_generation = tsbi->s_next_generation++;
+	spin_unlock(&tsbi->s_alloc_lock);
+	testfs_stat_inc(sb, TESTFS_STAT_ALLOCS);
+	testfs_stat_add(sb, TESTFS_STAT_BITMAP_SCANNED, scanned);
+
+	/*
+	 * testfs_write_inode() only fills the fields it knows about. The
+	 * table block may never have been written (mktestfs leaves unused
+	 * ones alone) or hold a freed inode, so start from zeroes.
+	 */
+	raw = testfs_get_inode(sb, ino, &bh);
+	if (!raw) {
+		spin_lock(&tsbi->s_alloc_lock);
+		testfs_clear_inode_bit(bitmap_bh->b_data, ino);
+		tsbi->s_free_inodes++;
+		spin_unlock(&tsbi->s_alloc_lock);
+		iput(inode);
+		trace_testfs_new_inode(dir, 0, mode, scanned, testfs_elapsed_ns(start));
+		return ERR_PTR(-EIO);
+	}
+	memset(raw, 0, sizeof(*raw));
+	mark_buffer_dirty(bh);
+	brelse(bh);
+
 	inode->i_ino = ino;
 	inode->i_mode = mode;
-	inode->i_gid = current->fsgid;
-	inode->i_uid = current->fsuid;
-	inode->i_mtime = inode->i_atime = inode->i_ctime = CURRENT_TIME_SEC;
+	inode->i_gid = current_fsgid();
+	inode->i_uid = current_fsuid();
+	inode->i_mtime = inode->i_atime = inode->i_ctime = CURRENT_TIME;
 
 	testfs_debug("Successfully allocated inodes....\n");
 	memset(tsi->i_data, 0 ,sizeof(tsi->i_data));
 	tsi->i_data[0] = ino;
 	tsi->state = TESTFS_INODE_ALLOCATED;
-	tsbi->s_free_inodes--;
 	sb->s_dirt = 1;
 	insert_inode_hash(inode);
 	mark_inode_dirty(inode);
 	mark_buffer_dirty(bitmap_bh);
 	sync_dirty_buffer(bitmap_bh);
+	testfs_stat_inc(sb, TESTFS_STAT_SYNC_WRITES);
 	testfs_debug("returning now\n");
+	trace_testfs_new_inode(dir, ino, mode, scanned, testfs_elapsed_ns(start));
 	return inode;
 }
@@ -9,10 +9,9 @@
 #include<linux/buffer_head.h>
 #include<linux/fs.h>
 #include<linux/mpage.h>
+#include<linux/uio.h>
 #include "testfs.h"
-
-static struct testfs_inode *testfs_get_inode(struct super_block *sb, unsigned int ino,
-				struct buffer_head **bhp);
+#include "testfs_trace.h"
 
 typedef struct {
 	__le32	*p;
@@ -39,7 +38,14 @@ static int testfs_block_to_path(struct inode *inode, long block, int offsets[1])
 	if(block < 0) {
 		testfs_debug("Block number less than zero (%ld)\n",block);
 	}
-	BUG_ON(block != 0);
+	/*
+	 * Files have only a single data block. Direct I/O can ask for
+	 * blocks beyond it, let the caller fail such requests.
+	 */
+	if (block != 0) {
+		testfs_debug("Block number beyond the data block (%ld)\n",block);
+		return 0;
+	}
 	offsets[n++] = block;
 	return n;
 }
@@ -82,14 +88,18 @@ static int testfs_get_blocks(struct inode *inode, sector_t block,
 
 	depth = testfs_block_to_path(inode, block, offsets);
 	if (!depth)
-		return err;
+		goto out;
 
 	partial = testfs_get_branch(inode, depth, offsets, chain, &err);
 
-	/* Block found */
+	/* Block found. Return the number of blocks mapped */
 	if (!partial) {
 		map_bh(bh, inode->i_sb, chain[depth -1].key);
+		/* Directory blocks live with the rest of the metadata */
+		if (S_ISDIR(inode->i_mode) && TESTFS_SB(inode->i_sb)->s_meta_bdev)
+			bh->b_bdev = TESTFS_SB(inode->i_sb)->s_meta_bdev;
 		partial = chain+depth-1;
+		err = 1;
 		goto cleanup;
 	}
 cleanup:
@@ -97,15 +107,23 @@ cleanup:
 		brelse(partial->bh);
 		partial --;
 	}
+out:
+	trace_testfs_get_blocks(inode, block, maxblocks,
+			buffer_mapped(bh) ? bh->b_blocknr : 0, err, create);
 	return err;
 }
 
+/*
+ * Map a file block. This doesn't sleep or do any I/O, so it can be used
+ * from the I/O submission path without blocking.
+ */
 int testfs_get_block(struct inode *inode, sector_t block, struct buffer_head *bh, int create)
 {
 	unsigned maxblocks = bh->b_size / inode->i_sb->s_blocksize;
 	int ret = testfs_get_blocks(inode, block, maxblocks, bh, create);
 	if(ret > 0) {
-		bh->b_size = (ret * 4096);
+		bh->b_size = (ret << inode->i_blkbits);
+		ret = 0;
 	}
 	return ret;
 }
@@ -121,6 +139,22 @@ static int testfs_readpages(struct file *file, struct address_space *mapping,
 	return mpage_readpages(mapping, pages, nr_pages, testfs_get_block);
 }
 
+/*
+ * Convert between the on disk and in memory timestamps
+ */
+static inline void testfs_decode_time(struct timespec *ts, struct testfs_timestamp *raw)
+{
+	ts->tv_sec = le64_to_cpu(raw->tv_sec);
+	ts->tv_nsec = le32_to_cpu(raw->tv_nsec);
+}
+
+static inline void testfs_encode_time(struct testfs_timestamp *raw, struct timespec *ts)
+{
+	raw->tv_sec = cpu_to_le64(ts->tv_sec);
+	raw->tv_nsec = cpu_to_le32(ts->tv_nsec);
+	raw->pad = 0;
+}
+
 /*
  * Get a new inode and fill it appropriately
  */
@@ -143,7 +177,19 @@ struct inode *testfs_iget(struct super_block *sb, unsigned int ino)
 	/* Get the raw disk inode and fill the buffer head */
 	raw_inode = testfs_get_inode(inode->i_sb, ino, &bh);
 	if (!raw_inode) {
-		return NULL;
+		/* Don't leave the inode locked for others waiting on it */
+		iget_failed(inode);
+		return ERR_PTR(-EIO);
+	}
+	/*
+	 * A free or unlinked inode, eg. asked for by a stale NFS handle.
+	 * Orphans still open are in the inode cache, the orphan list is
+	 * walked on the raw inodes.
+	 */
+	if (!raw_inode->nlinks) {
+		brelse(bh);
+		iget_failed(inode);
+		return ERR_PTR(-ESTALE);
 	}
 
 	inode->i_mode = le32_to_cpu(raw_inode->type);
@@ -151,25 +197,22 @@ struct inode *testfs_iget(struct super_block *sb, unsigned int ino)
 	inode->i_gid = le32_to_cpu(raw_inode->gid);
 	inode->i_size = le32_to_cpu(raw_inode->size);
 	inode->i_nlink = le32_to_cpu(raw_inode->nlinks);
-	inode->i_atime= (raw_inode->atime);
-	inode->i_ctime= (raw_inode->ctime);
-	inode->i_mtime= (raw_inode->mtime);
-
-	/*
-	inode->i_atime.tv_sec = le32_to_cpu(raw_inode->atime.tv_sec);
-	inode->i_ctime.tv_sec = le32_to_cpu(raw_inode->ctime.tv_sec);
-	inode->i_mtime.tv_sec = le32_to_cpu(raw_inode->mtime.tv_sec);
-	inode->i_atime.tv_nsec = inode->i_mtime.tv_nsec = inode->i_ctime.tv_nsec = 0;
-	*/
+	inode->i_generation = le32_to_cpu(raw_inode->generation);
+	testfs_decode_time(&inode->i_atime, &raw_inode->atime);
+	testfs_decode_time(&inode->i_ctime, &raw_inode->ctime);
+	testfs_decode_time(&inode->i_mtime, &raw_inode->mtime);
 
 	tsi->i_data[0] = raw_inode->data[0];
 	/*
 	 * Setup the proper operation routines depending
 	 * on the file type.
 	 */
+	inode->i_mapping->a_ops = &testfs_aops;
 	if (S_ISREG(inode->i_mode)) {
 		inode->i_op = &testfs_file_inode_operations;
 		inode->i_fop = &testfs_file_operations;
+		if (test_opt(sb, NOBH))
+			inode->i_mapping->a_ops = &testfs_nobh_aops;
 	} else if (S_ISDIR(inode->i_mode)) {
 		inode->i_op = &testfs_dir_inode_operations;
 		inode->i_fop = &testfs_dir_operations;
@@ -177,33 +220,35 @@ struct inode *testfs_iget(struct super_block *sb, unsigned int ino)
 		inode->i_op = &testfs_symlink_inode_operations;
 	}
 
-	inode->i_mapping->a_ops = &testfs_aops;
-
 	brelse(bh);
 	unlock_new_inode(inode);
 
 	return inode;
 }
 
-static struct testfs_inode *testfs_get_inode(struct super_block *sb, unsigned int ino,
+struct testfs_inode *testfs_get_inode(struct super_block *sb, unsigned int ino,
 				struct buffer_head **bhp)
 {
 	struct buffer_head *bh;
 	unsigned int offset;
 	unsigned int block;
-	unsigned int inodes_per_block;
 	struct testfs_super_block *ts = TESTFS_SB(sb)->s_ts;
 	*bhp = NULL;
 
-	inodes_per_block = sb->s_blocksize/(sizeof(struct testfs_inode));
-	block = (ino - ts->s_first_nonmeta_inode)/inodes_per_block;
-	BUG_ON(block > 2 || block < 0);
-	/* This offset is within a particular inode block */
-	offset = (ino - ts->s_first_nonmeta_inode)*sizeof(struct testfs_inode);
-
-	bh = sb_bread(sb, block + 3); /* Inode blocks are 3,4 & 5 */
+	BUG_ON(testfs_inode_location(ts, ino, &block, &offset));
+	bh = testfs_meta_getblk(sb, block);
+	/* Only count the lookups which miss the buffer cache */
+	if (bh && !buffer_uptodate(bh)) {
+		testfs_stat_inc(sb, TESTFS_STAT_ITABLE_READS);
+		ll_rw_block(READ, 1, &bh);
+		wait_on_buffer(bh);
+		if (!buffer_uptodate(bh)) {
+			brelse(bh);
+			bh = NULL;
+		}
+	}
 	if (!bh) {
-		testfs_debug("Unable to read inode block (%d)\n", block+3);
+		testfs_debug("Unable to read inode block (%d)\n", block);
 		return NULL;
 	}
 	*bhp = bh;
@@ -229,6 +274,14 @@ int __testfs_write_begin(struct file *file, struct address_space *mapping,
 	return block_write_begin(file, mapping, pos, len, flags, pagep, fsdata, testfs_get_block);
 }
 
+/*
+ * Files can't grow beyond a single block
+ */
+static inline int testfs_write_fits(struct inode *inode, loff_t pos, size_t len)
+{
+	return (pos + len) <= inode->i_sb->s_blocksize;
+}
+
 int testfs_write_begin(struct file *file, struct address_space *mapping,
 		loff_t pos, unsigned len, unsigned flags, struct page **pagep,
 		void **fsdata)
@@ -238,7 +291,7 @@ int testfs_write_begin(struct file *file, struct address_space *mapping,
 	if (file) {
 		inode = file->f_path.dentry->d_inode;
 		testfs_debug("filesize = %lld, pos = %lld, len = %u\n",inode->i_size, pos, len);
-		if ((pos + len) <= inode->i_sb->s_blocksize)
+		if (testfs_write_fits(inode, pos, len))
 			return __testfs_write_begin(file, mapping, pos, len, flags, pagep, fsdata);
 		else return -ENOSPC;
 	}
@@ -251,59 +304,263 @@ static int testfs_writepage(struct page *page, struct writeback_control *wbc)
 	return block_write_full_page(page, testfs_get_block, wbc);
 }
 
-/* sync the ondisk inode with the in memory one */
-static int testfs_update_inode(struct inode *inode)
+/*
+ * With "nobh" regular files don't keep buffer heads attached to
+ * their pagecache pages, the page is mapped with a single call of
+ * testfs_get_block() for all its blocks.
+ */
+static int testfs_nobh_write_begin(struct file *file, struct address_space *mapping,
+		loff_t pos, unsigned len, unsigned flags, struct page **pagep,
+		void **fsdata)
+{
+	*pagep = NULL;
+	if (!testfs_write_fits(mapping->host, pos, len))
+		return -ENOSPC;
+	return nobh_write_begin(file, mapping, pos, len, flags, pagep, fsdata,
+			testfs_get_block);
+}
+
+static int testfs_nobh_writepage(struct page *page, struct writeback_control *wbc)
+{
+	return nobh_writepage(page, testfs_get_block, wbc);
+}
+
+/*
+ * Direct I/O goes to the device through the same block mapping
+ * as the buffered path.
+ *
+ * The data block of an inode is fixed for its lifetime and the mapping
+ * lives in the in memory inode, so testfs_get_block() never allocates,
+ * frees or reads anything. Hence the no locking variant is safe and
+ * i_alloc_sem isn't taken. An O_DIRECT read is submitted without waiting
+ * for i_mutex, writes still take it in generic_file_aio_write() before
+ * they get here.
+ */
+static ssize_t testfs_direct_IO(int rw, struct kiocb *iocb, const struct iovec *iov,
+		loff_t offset, unsigned long nr_segs)
+{
+	struct file *file = iocb->ki_filp;
+	struct inode *inode = file->f_mapping->host;
+
+	if (rw == WRITE && !testfs_write_fits(inode, offset, iov_length(iov, nr_segs)))
+		return -ENOSPC;
+	return blockdev_direct_IO_no_locking(rw, iocb, inode, inode->i_sb->s_bdev,
+			iov, offset, nr_segs, testfs_get_block, NULL);
+}
+
+/*
+ * Returns true if the on disk inode differs from the in memory
+ * one only in its timestamps.
+ */
+static int testfs_only_times_dirty(struct testfs_inode *raw, struct inode *inode)
+{
+	return raw->size == cpu_to_le32(inode->i_size) &&
+		raw->nlinks == cpu_to_le32(inode->i_nlink) &&
+		raw->gid == cpu_to_le32(inode->i_gid) &&
+		raw->uid == cpu_to_le32(inode->i_uid) &&
+		raw->type == cpu_to_le32(inode->i_mode) &&
+		raw->data[0] == TESTFS_I(inode)->i_data[0];
+}
+
+/*
+ * Keep the timestamp only update of an inode in memory. Returns 0 if
+ * the inode has been deferred for too long and has to be written now.
+ */
+static int testfs_defer_times(struct inode *inode)
+{
+	struct testfs_inode_info *ti = TESTFS_I(inode);
+	struct testfs_sb_info *tsi = TESTFS_SB(inode->i_sb);
+	int deferred = 1;
+
+	mutex_lock(&tsi->s_lazy_mutex);
+	if (list_empty(&ti->i_lazy_list)) {
+		ti->i_lazy_since = jiffies;
+		list_add_tail(&ti->i_lazy_list, &tsi->s_lazy_inodes);
+		schedule_delayed_work(&tsi->s_lazy_work, TESTFS_LAZYTIME_EXPIRE);
+	} else if (time_after_eq(jiffies, ti->i_lazy_since + TESTFS_LAZYTIME_EXPIRE)) {
+		list_del_init(&ti->i_lazy_list);
+		deferred = 0;
+	}
+	mutex_unlock(&tsi->s_lazy_mutex);
+	return deferred;
+}
+
+/*
+ * The inode is going to be written completely, so forget
+ * about any deferred timestamps.
+ */
+static void testfs_undefer_times(struct inode *inode)
+{
+	struct testfs_inode_info *ti = TESTFS_I(inode);
+	struct testfs_sb_info *tsi = TESTFS_SB(inode->i_sb);
+
+	/* Only we add ourselves to the list, so the unlocked check is safe */
+	if (list_empty(&ti->i_lazy_list))
+		return;
+	mutex_lock(&tsi->s_lazy_mutex);
+	list_del_init(&ti->i_lazy_list);
+	mutex_unlock(&tsi->s_lazy_mutex);
+}
+
+/*
+ * Write back only the timestamps of an inode whose update was deferred.
+ * Called with s_lazy_mutex held, which keeps the inode from being freed.
+ */
+static void testfs_write_times(struct inode *inode)
+{
+	struct buffer_head *bh;
+	struct testfs_inode *raw = testfs_get_inode(inode->i_sb, inode->i_ino, &bh);
+
+	if (!raw) {
+		testfs_error("Unable to write timestamps of inode %lu\n", inode->i_ino);
+		return;
+	}
+	testfs_encode_time(&raw->atime, &inode->i_atime);
+	testfs_encode_time(&raw->mtime, &inode->i_mtime);
+	testfs_encode_time(&raw->ctime, &inode->i_ctime);
+	mark_buffer_dirty(bh);
+	brelse(bh);
+}
+
+/*
+ * Write the deferred timestamps of the inodes to their buffers. If all is not
+ * set only the ones which have been waiting for TESTFS_LAZYTIME_EXPIRE are
+ * written.
+ */
+void testfs_flush_lazy_inodes(struct super_block *sb, int all)
+{
+	struct testfs_sb_info *tsi = TESTFS_SB(sb);
+	struct testfs_inode_info *ti;
+
+	mutex_lock(&tsi->s_lazy_mutex);
+	while (!list_empty(&tsi->s_lazy_inodes)) {
+		/* The list is in the order in which inodes were deferred */
+		ti = list_entry(tsi->s_lazy_inodes.next, struct testfs_inode_info,
+				i_lazy_list);
+		if (!all && time_before(jiffies, ti->i_lazy_since + TESTFS_LAZYTIME_EXPIRE)) {
+			schedule_delayed_work(&tsi->s_lazy_work,
+				ti->i_lazy_since + TESTFS_LAZYTIME_EXPIRE - jiffies);
+			break;
+		}
+		list_del_init(&ti->i_lazy_list);
+		testfs_write_times(&ti->vfs_inode);
+	}
+	mutex_unlock(&tsi->s_lazy_mutex);
+}
+
+void testfs_lazytime_work(struct work_struct *work)
+{
+	struct testfs_sb_info *tsi = container_of(work, struct testfs_sb_info,
+						s_lazy_work.work);
+	testfs_flush_lazy_inodes(tsi->s_sb, 0);
+}
+
+/*
+ * The inode is being evicted from memory, don't lose its deferred times
+ */
+void testfs_clear_inode(struct inode *inode)
+{
+	struct testfs_inode_info *ti = TESTFS_I(inode);
+	struct testfs_sb_info *tsi = TESTFS_SB(inode->i_sb);
+
+	if (list_empty(&ti->i_lazy_list))
+		return;
+	mutex_lock(&tsi->s_lazy_mutex);
+	if (!list_empty(&ti->i_lazy_list)) {
+		list_del_init(&ti->i_lazy_list);
+		testfs_write_times(inode);
+	}
+	mutex_unlock(&tsi->s_lazy_mutex);
+}
+
+/*
+ * sync the ondisk inode with the in memory one. The inode buffer is
+ * written synchronously only if do_sync is set, otherwise it is left
+ * dirty for the regular writeback.
+ */
+static int testfs_update_inode(struct inode *inode, int do_sync)
 {
 	struct testfs_inode_info *tsi = TESTFS_I(inode);
 	struct super_block *sb = inode->i_sb;
 	unsigned int ino = inode->i_ino;
 	struct buffer_head *bh;
-	struct testfs_inode *raw = testfs_get_inode(sb, ino, &bh);
+	struct testfs_inode *raw;
+	ktime_t start = testfs_trace_start(testfs_update_inode);
+	int deferred = 0;
 	int err = 0;
 
-	if (!raw || IS_ERR(raw))
-		return -EIO;
+	raw = testfs_get_inode(sb, ino, &bh);
+	if (!raw || IS_ERR(raw)) {
+		err = -EIO;
+		goto out;
+	}
+
+	/*
+	 * With lazytime an update which only changes the timestamps (eg. atime)
+	 * stays in memory till the inode is written for some other reason.
+	 */
+	if (!do_sync && test_opt(sb, LAZYTIME) && testfs_only_times_dirty(raw, inode)) {
+		if (testfs_defer_times(inode)) {
+			brelse(bh);
+			deferred = 1;
+			goto out;
+		}
+	} else
+		testfs_undefer_times(inode);
 
 	/* Update the fields of on disk inode with those from memory */
 	testfs_debug("Inode (%lu) size = %lld , mode = 0x%x\n",inode->i_ino, inode->i_size, inode->i_mode);
 	raw->size = cpu_to_le32(inode->i_size);
-	raw->atime = (inode->i_atime);
-	raw->mtime = (inode->i_mtime);
-	raw->ctime = (inode->i_ctime);
+	testfs_encode_time(&raw->atime, &inode->i_atime);
+	testfs_encode_time(&raw->mtime, &inode->i_mtime);
+	testfs_encode_time(&raw->ctime, &inode->i_ctime);
 	raw->nlinks = cpu_to_le32(inode->i_nlink);
 	raw->gid = cpu_to_le32(inode->i_gid);
 	raw->uid = cpu_to_le32(inode->i_uid);
 	raw->type = cpu_to_le32(inode->i_mode);
+	raw->generation = cpu_to_le32(inode->i_generation);
 	testfs_debug("Data block = %u\n",tsi->i_data[0]);
 	raw->data[0] = tsi->i_data[0];
 
 	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
-	if (buffer_req(bh) && !buffer_uptodate(bh)) {
-		testfs_error("I/O error while syncing inode to disk\n");
-		err = -EIO;
+	if (do_sync) {
+		sync_dirty_buffer(bh);
+		testfs_stat_inc(sb, TESTFS_STAT_SYNC_WRITES);
+		if (buffer_req(bh) && !buffer_uptodate(bh)) {
+			testfs_error("I/O error while syncing inode to disk\n");
+			err = -EIO;
+		}
 	}
 	brelse(bh);
+out:
+	trace_testfs_update_inode(inode, do_sync, deferred, err, testfs_elapsed_ns(start));
 	return err;
 }
 
+/*
+ * The last reference to an unlinked inode is gone. The inode is only put
+ * on the orphan list here, its bitmap bit and block are freed in batches
+ * by testfs_release_orphans() so that unlink doesn't wait for the disk.
+ */
 void testfs_delete_inode(struct inode *inode)
 {
 	truncate_inode_pages(&inode->i_data, 0);
 	if(is_bad_inode(inode))
 		goto no_delete;
-	mark_inode_dirty(inode);
-	testfs_update_inode(inode);
 	inode->i_size = 0;
-	testfs_free_inode(inode);
-	return;
+	testfs_update_inode(inode, 0);
+	testfs_orphan_add(inode);
 no_delete:
 	clear_inode(inode);
 }
 
 int testfs_write_inode(struct inode *inode, int wait)
 {
-	return testfs_update_inode(inode);
+	ktime_t start = ktime_get();
+	int err = testfs_update_inode(inode, wait);
+
+	testfs_stat_latency(inode->i_sb, TESTFS_LAT_WRITE_INODE, start);
+	return err;
 }
 
 const struct address_space_operations testfs_aops = {
@@ -313,4 +570,15 @@ const struct address_space_operations testfs_aops = {
 	.write_begin = testfs_write_begin,
 	.write_end = generic_write_end,
 	.sync_page = block_sync_page,
+	.direct_IO = testfs_direct_IO,
+};
+
+const struct address_space_operations testfs_nobh_aops = {
+	.readpage = testfs_readpage,
+	.readpages = testfs_readpages,
+	.writepage = testfs_nobh_writepage,
+	.write_begin = testfs_nobh_write_begin,
+	.write_end = nobh_write_end,
+	.sync_page = block_sync_page,
+	.direct_IO = testfs_direct_IO,
 };
@@ -0,0 +1,198 @@
+/***********************************************************/
+/*  This is the readme for the testfs filesystem           */
+/*  Author : Manish Katiyar <mkatiyar@gmail.com>           */
+/*  Description : A simple disk based filesystem for linux */
+/*  Date   : 08/01/09                                      */
+/*  Version : 0.01                                         */
+/*  Distributed under GPL                                  */
+/***********************************************************/
+#include<linux/fs.h>
+#include<linux/file.h>
+#include<linux/pagemap.h>
+#include<linux/highmem.h>
+#include<linux/capability.h>
+#include<linux/uaccess.h>
+#include<linux/mount.h>
+#include "testfs.h"
+
+/*
+ * Discard the free blocks of the filesystem in the range given by user
+ */
+static int testfs_ioctl_fitrim(struct super_block *sb, unsigned long arg)
+{
+	struct fstrim_range range;
+	int err;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (copy_from_user(&range, (struct fstrim_range __user *)arg, sizeof(range)))
+		return -EFAULT;
+
+	err = testfs_trim_fs(sb, &range);
+	if (err)
+		return err;
+
+	if (copy_to_user((struct fstrim_range __user *)arg, &range, sizeof(range)))
+		return -EFAULT;
+	return 0;
+}
+
+/*
+ * Copy len bytes at soff of src to doff of the file being written and zero
+ * the next zero bytes after them. Files never grow beyond a block, so both
+ * ranges are in the first page. Called with the i_mutex of dst held.
+ */
+static int testfs_copy_range(struct inode *src, loff_t soff, struct file *dst_file,
+		loff_t doff, size_t len, size_t zero)
+{
+	struct address_space *mapping = dst_file->f_mapping;
+	struct page *spage, *dpage;
+	void *fsdata;
+	char *from, *to;
+	int err;
+
+	if (!len && !zero)
+		return 0;
+	spage = read_mapping_page(src->i_mapping, 0, NULL);
+	if (IS_ERR(spage))
+		return PTR_ERR(spage);
+	err = mapping->a_ops->write_begin(dst_file, mapping, doff, len + zero, 0,
+			&dpage, &fsdata);
+	if (err)
+		goto out;
+
+	from = kmap_atomic(spage, KM_USER0);
+	to = kmap_atomic(dpage, KM_USER1);
+	memmove(to + doff, from + soff, len);
+	memset(to + doff + len, 0, zero);
+	kunmap_atomic(to, KM_USER1);
+	kunmap_atomic(from, KM_USER0);
+	flush_dcache_page(dpage);
+
+	err = mapping->a_ops->write_end(dst_file, mapping, doff, len + zero, len + zero,
+			dpage, fsdata);
+	if (err >= 0)
+		err = (err == len + zero) ? 0 : -EIO;
+out:
+	page_cache_release(spage);
+	return err;
+}
+
+/*
+ * FICLONE and FICLONERANGE. A file is at most one block, so instead of
+ * sharing blocks between files the data is copied inside the kernel,
+ * which costs no more than updating block references would. With whole
+ * set the destination becomes an exact copy of the source.
+ */
+static int testfs_ioctl_clone(struct file *dst_file, int srcfd, u64 off, u64 olen,
+		u64 destoff, int whole)
+{
+	struct inode *dst = dst_file->f_path.dentry->d_inode;
+	unsigned long blocksize = dst->i_sb->s_blocksize;
+	struct file *src_file;
+	struct inode *src;
+	loff_t size, old_size;
+	size_t zero = 0;
+	int err;
+
+	if (!(dst_file->f_mode & FMODE_WRITE) || (dst_file->f_flags & O_APPEND))
+		return -EBADF;
+	src_file = fget(srcfd);
+	if (!src_file)
+		return -EBADF;
+	src = src_file->f_path.dentry->d_inode;
+
+	err = -EBADF;
+	if (!(src_file->f_mode & FMODE_READ))
+		goto out;
+	err = -EXDEV;
+	if (src->i_sb != dst->i_sb)
+		goto out;
+	err = -EINVAL;
+	if (!S_ISREG(src->i_mode) || !S_ISREG(dst->i_mode))
+		goto out;
+
+	mutex_lock(&dst->i_mutex);
+	size = i_size_read(src);
+	old_size = i_size_read(dst);
+	if (whole) {
+		off = destoff = 0;
+		olen = size;
+		/* Don't leave the old data beyond the end of the source */
+		if (old_size > size)
+			zero = old_size - size;
+	} else if (!olen) {
+		/* Zero length means upto the end of the source */
+		olen = off < size ? size - off : 0;
+	}
+	err = -EINVAL;
+	if (off + olen > size || off + olen < off || destoff + olen < destoff)
+		goto out_unlock;
+	if (src == dst && off < destoff + olen && destoff < off + olen)
+		goto out_unlock;
+	err = -ENOSPC;
+	if (destoff + olen + zero > blocksize)
+		goto out_unlock;
+
+	err = testfs_copy_range(src, off, dst_file, destoff, olen, zero);
+	if (err)
+		goto out_unlock;
+	if (whole && old_size > size)
+		i_size_write(dst, size);
+	dst->i_mtime = dst->i_ctime = CURRENT_TIME;
+	mark_inode_dirty(dst);
+out_unlock:
+	mutex_unlock(&dst->i_mutex);
+out:
+	fput(src_file);
+	return err;
+}
+
+static int testfs_ioctl_clone_range(struct file *filp, unsigned long arg)
+{
+	struct file_clone_range range;
+
+	if (copy_from_user(&range, (struct file_clone_range __user *)arg, sizeof(range)))
+		return -EFAULT;
+	return testfs_ioctl_clone(filp, range.src_fd, range.src_offset, range.src_length,
+			range.dest_offset, 0);
+}
+
+/*
+ * Grow the filesystem onto the space added to the device
+ */
+static int testfs_ioctl_resize(struct file *filp, struct super_block *sb, unsigned long arg)
+{
+	__u64 blocks;
+	int err;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (copy_from_user(&blocks, (__u64 __user *)arg, sizeof(blocks)))
+		return -EFAULT;
+	err = mnt_want_write(filp->f_path.mnt);
+	if (err)
+		return err;
+	err = testfs_resize_fs(sb, blocks);
+	mnt_drop_write(filp->f_path.mnt);
+	return err;
+}
+
+long testfs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct inode *inode = filp->f_path.dentry->d_inode;
+
+	testfs_debug("ioctl 0x%x on inode %lu\n", cmd, inode->i_ino);
+	switch (cmd) {
+	case FITRIM:
+		return testfs_ioctl_fitrim(inode->i_sb, arg);
+	case FICLONE:
+		return testfs_ioctl_clone(filp, arg, 0, 0, 0, 1);
+	case FICLONERANGE:
+		return testfs_ioctl_clone_range(filp, arg);
+	case TESTFS_IOC_RESIZE_FS:
+		return testfs_ioctl_resize(filp, inode->i_sb, arg);
+	default:
+		return -ENOTTY;
+	}
+}
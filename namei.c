@@ -28,6 +28,7 @@ static int testfs_add_dentry(struct dentry *dentry, struct inode *inode)
 
 static int testfs_create(struct inode *dir, struct dentry *dentry, int mode, struct nameidata *nd)
 {
+	ktime_t start = ktime_get();
 	struct inode *inode = testfs_new_inode(dir, mode);
 	int err = PTR_ERR(inode);
 	if (!IS_ERR(inode)) {
@@ -39,7 +40,10 @@ static int testfs_create(struct inode *dir, struct dentry *dentry, int mode, str
 		 */
 		inode->i_op = &testfs_file_inode_operations;
 		inode->i_fop = &testfs_file_operations;
-		inode->i_mapping->a_ops = &testfs_aops;
+		if (test_opt(dir->i_sb, NOBH))
+			inode->i_mapping->a_ops = &testfs_nobh_aops;
+		else
+			inode->i_mapping->a_ops = &testfs_aops;
 
 		/* Mark the inode dirty so that it gets written */
 		mark_inode_dirty(inode);
@@ -48,27 +52,51 @@ static int testfs_create(struct inode *dir, struct dentry *dentry, int mode, str
 		err = testfs_add_dentry(dentry, inode);
 	}
 	testfs_debug("I hope nothing is wrong here err = %d\n",err);
+	testfs_stat_latency(dir->i_sb, TESTFS_LAT_CREATE, start);
 	return err;
 }
 
 static struct dentry *testfs_lookup(struct inode *dir, struct dentry *dentry, struct nameidata *nd)
 {
 	struct inode *inode = NULL;
+	struct dentry *ret;
 	unsigned int ino;
+	ktime_t start = ktime_get();
 
 	//testfs_debug("Looking up file \"%s\" in dir inode %lu\n",dentry->d_name.name, dir->i_ino);
-	if(dentry->d_name.len > TESTFS_MAX_NAME_LEN)
-		return ERR_PTR(-ENAMETOOLONG);
+	testfs_stat_inc(dir->i_sb, TESTFS_STAT_LOOKUPS);
+	if(dentry->d_name.len > TESTFS_MAX_NAME_LEN) {
+		ret = ERR_PTR(-ENAMETOOLONG);
+		goto out;
+	}
 
 	ino = testfs_inode_by_name(dir, &dentry->d_name);
-
 	if (ino) {
 		inode = testfs_iget(dir->i_sb, ino);
-		if (IS_ERR(inode))
-			return ERR_CAST(inode);
-	}
+		if (IS_ERR(inode)) {
+			ret = ERR_CAST(inode);
+			goto out;
+		}
+	} else
+		testfs_stat_inc(dir->i_sb, TESTFS_STAT_NEG_LOOKUPS);
+
+	ret = d_splice_alias(inode, dentry);
+out:
+	testfs_stat_latency(dir->i_sb, TESTFS_LAT_LOOKUP, start);
+	return ret;
+}
+
+/*
+ * Parent of a directory for NFS, from its ".." entry
+ */
+struct dentry *testfs_get_parent(struct dentry *child)
+{
+	struct qstr dotdot = {.name = "..", .len = 2};
+	unsigned int ino = testfs_inode_by_name(child->d_inode, &dotdot);
 
-	return d_splice_alias(inode, dentry);
+	if (!ino)
+		return ERR_PTR(-ENOENT);
+	return d_obtain_alias(testfs_iget(child->d_inode->i_sb, ino));
 }
 
 static int testfs_unlink(struct inode *dir, struct dentry *dentry)
@@ -77,6 +105,7 @@ static int testfs_unlink(struct inode *dir, struct dentry *dentry)
 	struct testfs_dir_entry *de;
 	struct page *page;
 	int err = -ENOENT;
+	ktime_t start = ktime_get();
 
 	testfs_debug("Deleting file \"%s\"\n",dentry->d_name.name);
 	de = testfs_find_dentry(dir, &dentry->d_name, &page);
@@ -91,6 +120,7 @@ static int testfs_unlink(struct inode *dir, struct dentry *dentry)
 	}
 	inode_dec_link_count(inode);
 out:
+	testfs_stat_latency(dir->i_sb, TESTFS_LAT_UNLINK, start);
 	return err;
 }
 
@@ -139,5 +169,4 @@ const struct inode_operations testfs_dir_inode_operations = {
 	//.rename = testfs_rename,
 	.symlink = testfs_symlink,
 	.setattr = testfs_setattr,
-	.permission = testfs_permission,
 };
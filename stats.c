@@ -0,0 +1,174 @@
+/***********************************************************/
+/*  This is the readme for the testfs filesystem           */
+/*  Author : Manish Katiyar <mkatiyar@gmail.com>           */
+/*  Description : A simple disk based filesystem for linux */
+/*  Date   : 08/01/09                                      */
+/*  Version : 0.01                                         */
+/*  Distributed under GPL                                  */
+/***********************************************************/
+#include<linux/fs.h>
+#include<linux/debugfs.h>
+#include<linux/seq_file.h>
+#include<linux/bitops.h>
+#include<linux/module.h>
+#include<linux/slab.h>
+#include<asm/div64.h>
+#include "testfs.h"
+
+static struct dentry *testfs_debugfs_root; /* /sys/kernel/debug/testfs */
+
+static const char *testfs_stat_names[TESTFS_NR_STATS] = {
+	[TESTFS_STAT_LOOKUPS]		= "lookups",
+	[TESTFS_STAT_NEG_LOOKUPS]	= "negative_lookups",
+	[TESTFS_STAT_DENTRY_SEARCHES]	= "dentry_searches",
+	[TESTFS_STAT_DIRENTS_SCANNED]	= "dirents_scanned",
+	[TESTFS_STAT_ALLOCS]		= "inode_allocs",
+	[TESTFS_STAT_BITMAP_SCANNED]	= "bitmap_bytes_scanned",
+	[TESTFS_STAT_SYNC_WRITES]	= "sync_writes",
+	[TESTFS_STAT_ITABLE_READS]	= "inode_table_reads",
+	[TESTFS_STAT_ORPHANS]		= "orphans",
+	[TESTFS_STAT_ORPHAN_BATCHES]	= "orphan_batches",
+};
+
+static const char *testfs_lat_names[TESTFS_NR_LATS] = {
+	[TESTFS_LAT_CREATE]		= "create",
+	[TESTFS_LAT_LOOKUP]		= "lookup",
+	[TESTFS_LAT_UNLINK]		= "unlink",
+	[TESTFS_LAT_WRITE_INODE]	= "write_inode",
+};
+
+/*
+ * Account the time taken by an operation which started at start
+ */
+void testfs_stat_latency(struct super_block *sb, enum testfs_lat lat, ktime_t start)
+{
+	u64 ns = testfs_elapsed_ns(start);
+	int bucket = ns ? fls64(ns) - 1 : 0;
+	struct testfs_stats *st;
+
+	if (bucket >= TESTFS_LAT_BUCKETS)
+		bucket = TESTFS_LAT_BUCKETS - 1;
+	st = per_cpu_ptr(TESTFS_SB(sb)->s_stats, get_cpu());
+	st->lat[lat][bucket]++;
+	put_cpu();
+}
+
+/*
+ * Sum up the per cpu statistics
+ */
+static void testfs_stats_sum(struct super_block *sb, struct testfs_stats *sum)
+{
+	int cpu, i, j;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		struct testfs_stats *st = per_cpu_ptr(TESTFS_SB(sb)->s_stats, cpu);
+		for (i = 0; i < TESTFS_NR_STATS; i++)
+			sum->count[i] += st->count[i];
+		for (i = 0; i < TESTFS_NR_LATS; i++)
+			for (j = 0; j < TESTFS_LAT_BUCKETS; j++)
+				sum->lat[i][j] += st->lat[i][j];
+	}
+}
+
+static u64 testfs_ratio(u64 num, u64 den)
+{
+	if (!den)
+		return 0;
+	do_div(num, den);
+	return num;
+}
+
+static int testfs_stats_show(struct seq_file *m, void *v)
+{
+	struct super_block *sb = m->private;
+	struct testfs_stats *sum;
+	int i, j;
+
+	sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+	if (!sum)
+		return -ENOMEM;
+	testfs_stats_sum(sb, sum);
+
+	for (i = 0; i < TESTFS_NR_STATS; i++)
+		seq_printf(m, "%-24s %llu\n", testfs_stat_names[i],
+				(unsigned long long)sum->count[i]);
+	seq_printf(m, "%-24s %llu\n", "dirents_per_search",
+			(unsigned long long)testfs_ratio(sum->count[TESTFS_STAT_DIRENTS_SCANNED],
+				sum->count[TESTFS_STAT_DENTRY_SEARCHES]));
+	seq_printf(m, "%-24s %llu\n", "bitmap_bytes_per_alloc",
+			(unsigned long long)testfs_ratio(sum->count[TESTFS_STAT_BITMAP_SCANNED],
+				sum->count[TESTFS_STAT_ALLOCS]));
+
+	for (i = 0; i < TESTFS_NR_LATS; i++) {
+		seq_printf(m, "\n%s latency (ns):\n", testfs_lat_names[i]);
+		for (j = 0; j < TESTFS_LAT_BUCKETS; j++) {
+			if (!sum->lat[i][j])
+				continue;
+			seq_printf(m, "  [%12llu, %12llu) %llu\n", 1ULL << j, 2ULL << j,
+					(unsigned long long)sum->lat[i][j]);
+		}
+	}
+	kfree(sum);
+	return 0;
+}
+
+static int testfs_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, testfs_stats_show, inode->i_private);
+}
+
+static const struct file_operations testfs_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = testfs_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/*
+ * Setup the statistics of a newly mounted filesystem. They are shown
+ * in /sys/kernel/debug/testfs/<device>/stats
+ */
+int testfs_stats_init(struct super_block *sb)
+{
+	struct testfs_sb_info *tsi = TESTFS_SB(sb);
+
+	tsi->s_stats = alloc_percpu(struct testfs_stats);
+	if (!tsi->s_stats)
+		return -ENOMEM;
+
+	/* Not having the debugfs files is not fatal */
+	if (!testfs_debugfs_root)
+		return 0;
+	tsi->s_debugfs = debugfs_create_dir(sb->s_id, testfs_debugfs_root);
+	if (!tsi->s_debugfs || IS_ERR(tsi->s_debugfs)) {
+		tsi->s_debugfs = NULL;
+		return 0;
+	}
+	debugfs_create_file("stats", S_IRUGO, tsi->s_debugfs, sb, &testfs_stats_fops);
+	return 0;
+}
+
+void testfs_stats_exit(struct super_block *sb)
+{
+	struct testfs_sb_info *tsi = TESTFS_SB(sb);
+
+	debugfs_remove_recursive(tsi->s_debugfs);
+	tsi->s_debugfs = NULL;
+	if (tsi->s_stats)
+		free_percpu(tsi->s_stats);
+	tsi->s_stats = NULL;
+}
+
+void testfs_debugfs_init(void)
+{
+	testfs_debugfs_root = debugfs_create_dir("testfs", NULL);
+	if (IS_ERR(testfs_debugfs_root))
+		testfs_debugfs_root = NULL;
+}
+
+void testfs_debugfs_exit(void)
+{
+	debugfs_remove_recursive(testfs_debugfs_root);
+}
@@ -10,10 +10,14 @@
 #include<linux/buffer_head.h>
 #include<linux/vfs.h>
 #include<linux/mount.h>
+#include<linux/parser.h>
+#include<linux/exportfs.h>
+#include<linux/random.h>
 #include "testfs.h"
 
-#define TESTFS_DFLT_BLOCKSIZE 4096
-#define TESTFS_SUPERBLOCK 1 /* Default blocknumber for superblock */
+#define CREATE_TRACE_POINTS
+#include "testfs_trace.h"
+
 static struct kmem_cache *testfs_inode_cachep; /* Testfs inode cache pointer */
 
 /*
@@ -26,21 +30,166 @@ static struct inode *testfs_alloc_inode(struct super_block *sb)
 	if (!tsi)
 		return NULL;
 	tsi->vfs_inode.i_version = 1;
+	INIT_LIST_HEAD(&tsi->i_lazy_list);
 	return &tsi->vfs_inode;
 }
 
 static void testfs_commit_super(struct super_block *sb, struct testfs_super_block *ts)
 {
+	ts->s_free_inodes = cpu_to_le32(TESTFS_SB(sb)->s_free_inodes);
 	mark_buffer_dirty(TESTFS_SB(sb)->s_bh);
 	sb->s_dirt = 0;
 }
 static void testfs_sync_super(struct super_block *sb, struct testfs_super_block *ts)
 {
+	ts->s_free_inodes = cpu_to_le32(TESTFS_SB(sb)->s_free_inodes);
 	mark_buffer_dirty(TESTFS_SB(sb)->s_bh);
 	sync_dirty_buffer(TESTFS_SB(sb)->s_bh);
+	testfs_stat_inc(sb, TESTFS_STAT_SYNC_WRITES);
 	sb->s_dirt = 0;
 }
 
+/*
+ * Read a block of the bitmap or inode table. They are on the metadata
+ * device if the filesystem has one.
+ */
+struct buffer_head *testfs_meta_bread(struct super_block *sb, sector_t block)
+{
+	struct block_device *bdev = TESTFS_SB(sb)->s_meta_bdev;
+
+	if (bdev)
+		return __bread(bdev, block, sb->s_blocksize);
+	return sb_bread(sb, block);
+}
+
+/*
+ * Like testfs_meta_bread() but without reading the block in
+ */
+struct buffer_head *testfs_meta_getblk(struct super_block *sb, sector_t block)
+{
+	struct block_device *bdev = TESTFS_SB(sb)->s_meta_bdev;
+
+	if (bdev)
+		return __getblk(bdev, block, sb->s_blocksize);
+	return sb_getblk(sb, block);
+}
+
+/*
+ * Open the metadata device and check that it belongs to this filesystem
+ */
+static int testfs_open_metadev(struct super_block *sb, char *path)
+{
+	struct testfs_sb_info *tsi = TESTFS_SB(sb);
+	struct testfs_super_block *mts;
+	struct block_device *bdev;
+	struct buffer_head *bh;
+	fmode_t mode = FMODE_READ;
+	int err = -EINVAL;
+
+	if (!(sb->s_flags & MS_RDONLY))
+		mode |= FMODE_WRITE;
+	bdev = open_bdev_exclusive(path, mode, sb);
+	if (IS_ERR(bdev)) {
+		printk("TESTFS: Unable to open metadata device \"%s\"\n", path);
+		return PTR_ERR(bdev);
+	}
+	if (set_blocksize(bdev, sb->s_blocksize)) {
+		printk("TESTFS: Blocksize %lu not supported by metadata device\n", sb->s_blocksize);
+		goto fail;
+	}
+	bh = __bread(bdev, TESTFS_SUPERBLOCK, sb->s_blocksize);
+	if (!bh) {
+		err = -EIO;
+		goto fail;
+	}
+	mts = (struct testfs_super_block *)bh->b_data;
+	if (le32_to_cpu(mts->s_magic) != TESTFS_MAGIC ||
+			mts->s_meta_id != tsi->s_ts->s_meta_id) {
+		printk("TESTFS: \"%s\" is not the metadata device of this filesystem\n", path);
+		brelse(bh);
+		goto fail;
+	}
+	brelse(bh);
+	tsi->s_meta_bdev = bdev;
+	tsi->s_meta_mode = mode;
+	return 0;
+fail:
+	close_bdev_exclusive(bdev, mode);
+	return err;
+}
+
+static void testfs_close_metadev(struct super_block *sb)
+{
+	struct testfs_sb_info *tsi = TESTFS_SB(sb);
+
+	if (!tsi->s_meta_bdev)
+		return;
+	sync_blockdev(tsi->s_meta_bdev);
+	close_bdev_exclusive(tsi->s_meta_bdev, tsi->s_meta_mode);
+	tsi->s_meta_bdev = NULL;
+}
+
+/*
+ * Grow the filesystem to use blocks blocks of the device. As blocks and
+ * inodes go 1:1 this only raises s_max_inodes, the new inodes are already
+ * free in the bitmap and their slots in the inode table are filled when
+ * they get allocated. The inode table puts a limit on how far we can go,
+ * mktestfs -N can make it larger than the device to leave room.
+ */
+int testfs_resize_fs(struct super_block *sb, u64 blocks)
+{
+	struct testfs_sb_info *tsi = TESTFS_SB(sb);
+	struct testfs_super_block *ts = tsi->s_ts;
+	u64 dev_blocks = i_size_read(sb->s_bdev->bd_inode) >> sb->s_blocksize_bits;
+	unsigned int old_max = tsi->s_max_inodes;
+	unsigned int new_max;
+	u64 want;
+	struct buffer_head *bh;
+
+	/* Directory blocks have to fit on the metadata device as well */
+	if (tsi->s_meta_bdev)
+		dev_blocks = min_t(u64, dev_blocks,
+			i_size_read(tsi->s_meta_bdev->bd_inode) >> sb->s_blocksize_bits);
+	if (!blocks)
+		blocks = dev_blocks;
+	if (blocks > dev_blocks || blocks <= tsi->s_first_nonmeta_inode)
+		return -EINVAL;
+	/* Inode numbers go upto the number of blocks */
+	want = blocks;
+	new_max = min_t(u64, want,
+			TESTFS_MAX_INODES(sb->s_blocksize, TESTFS_ITABLE_BLOCKS(ts)));
+	/* Nor can the single bitmap block */
+	new_max = min_t(u64, new_max, sb->s_blocksize * 8);
+	if (new_max < old_max) {
+		testfs_debug("Shrinking from %u to %u inodes is not supported\n", old_max, new_max);
+		return -EINVAL;
+	}
+	if (new_max == old_max) {
+		if (want == old_max)
+			return 0;
+		printk(KERN_WARNING "TESTFS: %s: inode table is full at %u inodes, "
+				"can't grow to %llu blocks\n", sb->s_id, old_max,
+				(unsigned long long)blocks);
+		return -ENOSPC;
+	}
+
+	/* Make sure the new blocks are really there */
+	bh = sb_bread(sb, new_max - 1);
+	if (!bh)
+		return -EIO;
+	brelse(bh);
+
+	spin_lock(&tsi->s_alloc_lock);
+	tsi->s_free_inodes += new_max - old_max;
+	tsi->s_max_inodes = new_max;
+	ts->s_free_inodes = cpu_to_le32(tsi->s_free_inodes);
+	ts->s_max_inodes = cpu_to_le32(new_max);
+	spin_unlock(&tsi->s_alloc_lock);
+	testfs_sync_super(sb, ts);
+	printk(KERN_INFO "TESTFS: %s: grown from %u to %u inodes\n", sb->s_id, old_max, new_max);
+	return 0;
+}
+
 /*
  * Free the allocated structures for testfs superblock
  */
@@ -48,10 +197,22 @@ static void testfs_put_super(struct super_block *sb)
 {
 	struct testfs_sb_info *tsi = TESTFS_SB(sb);
 	struct testfs_super_block *ts = tsi->s_ts;
-	testfs_sync_super(sb, ts);
+	cancel_delayed_work_sync(&tsi->s_lazy_work);
+	cancel_delayed_work_sync(&tsi->s_orphan_work);
+	testfs_release_orphans(sb);
+	/* Don't leave the last batch of freed blocks undiscarded */
+	cancel_delayed_work_sync(&tsi->s_discard_work);
+	testfs_discard_pending(sb);
+	if (!(sb->s_flags & MS_RDONLY))
+		testfs_sync_super(sb, ts);
+	testfs_stats_exit(sb);
 	brelse(tsi->inode_bitmap);
 	brelse(tsi->s_bh);
+	testfs_close_metadev(sb);
 	sb->s_fs_info = NULL;
+	kfree(tsi->s_discard_map);
+	kfree(tsi->s_orphan_map);
+	kfree(tsi->s_orphan_dirs);
 	kfree(tsi);
 }
 
@@ -64,6 +225,103 @@ void testfs_write_super(struct super_block *sb)
 	sb->s_dirt = 0;
 	unlock_kernel();
 }
+static int testfs_sync_fs(struct super_block *sb, int wait)
+{
+	/* sync has to write the timestamps deferred by lazytime as well */
+	testfs_flush_lazy_inodes(sb, 1);
+	/* and make the pending unlinks durable */
+	testfs_release_orphans(sb);
+	if (wait && TESTFS_SB(sb)->s_meta_bdev)
+		sync_blockdev(TESTFS_SB(sb)->s_meta_bdev);
+	return 0;
+}
+
+enum {
+	Opt_lazytime, Opt_nolazytime, Opt_discard, Opt_nodiscard, Opt_nobh, Opt_metadev,
+	Opt_err
+};
+
+static const match_table_t tokens = {
+	{Opt_lazytime, "lazytime"},
+	{Opt_nolazytime, "nolazytime"},
+	{Opt_discard, "discard"},
+	{Opt_nodiscard, "nodiscard"},
+	{Opt_nobh, "nobh"},
+	{Opt_metadev, "metadev=%s"},
+	{Opt_err, NULL}
+};
+
+/*
+ * Parse the mount options. Returns 0 if an invalid option is found. The
+ * metadata device is returned in metadev, it can't change on remount
+ * where metadev is NULL.
+ */
+static int parse_options(char *options, struct testfs_sb_info *tsi, char **metadev)
+{
+	char *p;
+	substring_t args[MAX_OPT_ARGS];
+
+	if (!options)
+		return 1;
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		int token;
+		if (!*p)
+			continue;
+
+		token = match_token(p, tokens, args);
+		switch (token) {
+		case Opt_lazytime:
+			set_opt(tsi->s_mount_opt, LAZYTIME);
+			break;
+		case Opt_nolazytime:
+			clear_opt(tsi->s_mount_opt, LAZYTIME);
+			break;
+		case Opt_discard:
+			set_opt(tsi->s_mount_opt, DISCARD);
+			break;
+		case Opt_nodiscard:
+			clear_opt(tsi->s_mount_opt, DISCARD);
+			break;
+		case Opt_nobh:
+			set_opt(tsi->s_mount_opt, NOBH);
+			break;
+		case Opt_metadev:
+			if (!metadev)
+				break;
+			kfree(*metadev);
+			*metadev = match_strdup(&args[0]);
+			if (!*metadev)
+				return 0;
+			break;
+		default:
+			printk("TESTFS: Unrecognized mount option \"%s\"\n", p);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int testfs_remount(struct super_block *sb, int *flags, char *data)
+{
+	struct testfs_sb_info *tsi = TESTFS_SB(sb);
+	unsigned long old_opts = tsi->s_mount_opt;
+
+	if (!parse_options(data, tsi, NULL)) {
+		tsi->s_mount_opt = old_opts;
+		return -EINVAL;
+	}
+	if (testfs_has_feature(sb, PACKED) && !(*flags & MS_RDONLY)) {
+		tsi->s_mount_opt = old_opts;
+		return -EROFS;
+	}
+	if (!test_opt(sb, LAZYTIME) || (*flags & MS_RDONLY))
+		testfs_flush_lazy_inodes(sb, 1);
+	if (*flags & MS_RDONLY)
+		testfs_release_orphans(sb);
+	return 0;
+}
+
 /*
  * Free an inode in inode cache
  */
@@ -72,13 +330,61 @@ static void testfs_destroy_inode(struct inode *inode)
 	kmem_cache_free(testfs_inode_cachep, TESTFS_I(inode));
 	return;
 }
+/*
+ * NFS file handles carry the inode number and generation, decode them
+ * straight to the inode
+ */
+static struct inode *testfs_nfs_get_inode(struct super_block *sb, u64 ino, u32 generation)
+{
+	struct testfs_sb_info *tsi = TESTFS_SB(sb);
+	struct inode *inode;
+
+	if (ino != TESTFS_ROOT_INODE(tsi) &&
+			(ino <= tsi->s_first_nonmeta_inode || ino >= tsi->s_max_inodes))
+		return ERR_PTR(-ESTALE);
+	/* Never read in a free inode, deleting it again would free it twice */
+	if (!testfs_inode_in_use(sb, ino))
+		return ERR_PTR(-ESTALE);
+	inode = testfs_iget(sb, ino);
+	if (IS_ERR(inode))
+		return ERR_CAST(inode);
+	/* The inode was deleted, and maybe reused, since the handle was given out */
+	if (!inode->i_nlink || (generation && inode->i_generation != generation)) {
+		iput(inode);
+		return ERR_PTR(-ESTALE);
+	}
+	return inode;
+}
+
+static struct dentry *testfs_fh_to_dentry(struct super_block *sb, struct fid *fid,
+		int fh_len, int fh_type)
+{
+	return generic_fh_to_dentry(sb, fid, fh_len, fh_type, testfs_nfs_get_inode);
+}
+
+static struct dentry *testfs_fh_to_parent(struct super_block *sb, struct fid *fid,
+		int fh_len, int fh_type)
+{
+	return generic_fh_to_parent(sb, fid, fh_len, fh_type, testfs_nfs_get_inode);
+}
+
+static const struct export_operations testfs_export_ops = {
+	.fh_to_dentry = testfs_fh_to_dentry,
+	.fh_to_parent = testfs_fh_to_parent,
+	.get_parent = testfs_get_parent,
+};
+
 static const struct super_operations testfs_sops = {
 	.alloc_inode   = testfs_alloc_inode,
 	.write_inode   = testfs_write_inode,
 	.delete_inode  = testfs_delete_inode,
+	.clear_inode   = testfs_clear_inode,
 	.destroy_inode = testfs_destroy_inode,
 	.put_super     = testfs_put_super,
 	.write_super   = testfs_write_super,
+	.sync_fs       = testfs_sync_fs,
+	.remount_fs    = testfs_remount,
+	.show_options  = generic_show_options,
 };
 static int testfs_fill_super(struct super_block *sb, void *data, int silent)
 {
@@ -86,23 +392,56 @@ static int testfs_fill_super(struct super_block *sb, void *data, int silent)
 	struct testfs_super_block *ts;
 	struct inode *root;
 	struct buffer_head *bh = NULL;
+	char *metadev = NULL;
 	unsigned int blocksize ;
 	tsi = kzalloc(sizeof(*tsi), GFP_KERNEL);
 	if(!tsi)
 		return -ENOMEM;
 	sb->s_fs_info = tsi;
+	tsi->s_sb = sb;
+	mutex_init(&tsi->s_lazy_mutex);
+	INIT_LIST_HEAD(&tsi->s_lazy_inodes);
+	INIT_DELAYED_WORK(&tsi->s_lazy_work, testfs_lazytime_work);
+	spin_lock_init(&tsi->s_alloc_lock);
+	mutex_init(&tsi->s_discard_mutex);
+	INIT_DELAYED_WORK(&tsi->s_discard_work, testfs_discard_work);
+	mutex_init(&tsi->s_orphan_mutex);
+	INIT_DELAYED_WORK(&tsi->s_orphan_work, testfs_orphan_work);
+	save_mount_options(sb, data);
 
-	/* Read the superblock */
-	blocksize = sb_min_blocksize(sb, TESTFS_DFLT_BLOCKSIZE);
-	testfs_debug("Got blocksize as %u\n", blocksize);
-	bh = sb_bread(sb, TESTFS_SUPERBLOCK);
+	/*
+	 * Read the superblock. It lives in block 1, so where it is depends
+	 * on the blocksize the filesystem was created with. Try all the
+	 * blocksizes we can handle till we find one that matches.
+	 */
+	for (blocksize = TESTFS_MIN_BLOCKSIZE; blocksize <= PAGE_CACHE_SIZE; blocksize <<= 1) {
+		if (!sb_set_blocksize(sb, blocksize))
+			continue;
+		bh = sb_bread(sb, TESTFS_SUPERBLOCK);
+		if (!bh)
+			continue;
+		ts = (struct testfs_super_block *)((char *)bh->b_data);
+		if (le32_to_cpu(ts->s_magic) == TESTFS_MAGIC &&
+				le32_to_cpu(ts->s_blocksize) == blocksize)
+			break;
+		if (le32_to_cpu(ts->s_magic) == TESTFS_OLD_MAGIC &&
+				le32_to_cpu(ts->s_blocksize) == blocksize) {
+			printk("TESTFS: %s has the old inode format, recreate it with mktestfs\n",
+					sb->s_id);
+			brelse(bh);
+			goto fail;
+		}
+		brelse(bh);
+		bh = NULL;
+	}
 	if(!bh) {
-		printk("Unable to read superblock\n");
+		printk("Unable to find testfs superblock with blocksize upto %lu\n",
+				PAGE_CACHE_SIZE);
 		goto fail;
 	}
+	testfs_debug("Got blocksize as %u\n", blocksize);
 
 	/* Fill in memory data structures */
-	ts = (struct testfs_super_block *)((char *)bh->b_data);
 	tsi->s_ts = ts;
 	tsi->s_bh = bh;
 	tsi->s_free_inodes = ts->s_free_inodes;
@@ -112,11 +451,66 @@ static int testfs_fill_super(struct super_block *sb, void *data, int silent)
 	testfs_debug("Read magic number as 0x%x\n", (unsigned int)sb->s_magic);
 	if(sb->s_magic != le32_to_cpu(TESTFS_MAGIC))
 		goto bad_magic;
+	if (tsi->s_first_nonmeta_inode < TESTFS_INODE_TABLE_BLOCK + TESTFS_ITABLE_BLOCKS(ts) ||
+			tsi->s_max_inodes > TESTFS_MAX_INODES(blocksize, TESTFS_ITABLE_BLOCKS(ts))) {
+		printk("TESTFS: %u inodes don't fit in the %u block inode table\n",
+				tsi->s_max_inodes, TESTFS_ITABLE_BLOCKS(ts));
+		goto fail1;
+	}
+	if (tsi->s_max_inodes > blocksize * 8) {
+		printk("TESTFS: %u inodes don't fit in the bitmap block\n", tsi->s_max_inodes);
+		goto fail1;
+	}
+
+	if (!parse_options((char *)data, tsi, &metadev))
+		goto fail1;
+
+	/* Packed images can't be modified, they have no room to grow */
+	if (le32_to_cpu(ts->s_features) & TESTFS_FEATURE_PACKED)
+		sb->s_flags |= MS_RDONLY;
+
+	if (le32_to_cpu(ts->s_features) & TESTFS_FEATURE_METADEV) {
+		if (!metadev) {
+			printk("TESTFS: Filesystem needs the metadev= mount option\n");
+			goto fail1;
+		}
+		if (testfs_open_metadev(sb, metadev))
+			goto fail1;
+	} else if (metadev) {
+		printk("TESTFS: Filesystem wasn't created with a metadata device\n");
+		goto fail1;
+	}
+	kfree(metadev);
+	metadev = NULL;
+
+	tsi->s_discard_map = kzalloc(sb->s_blocksize, GFP_KERNEL);
+	if (!tsi->s_discard_map)
+		goto fail1;
+	tsi->s_orphan_map = kzalloc(sb->s_blocksize, GFP_KERNEL);
+	if (!tsi->s_orphan_map)
+		goto fail1;
+	tsi->s_orphan_dirs = kzalloc(sb->s_blocksize, GFP_KERNEL);
+	if (!tsi->s_orphan_dirs)
+		goto fail1;
+
+	if (testfs_stats_init(sb))
+		goto fail1;
+
+	/* Timestamps are kept with nanosecond resolution on disk */
+	sb->s_time_gran = 1;
 
 	/*
 	 * Setup other usefule fields of superblock
 	 */
 	sb->s_op = &testfs_sops;
+	sb->s_export_op = &testfs_export_ops;
+	get_random_bytes(&tsi->s_next_generation, sizeof(tsi->s_next_generation));
+	/* Finish the unlinks which were interrupted by a crash */
+	if (!(sb->s_flags & MS_RDONLY))
+		testfs_orphan_cleanup(sb);
+	else if (ts->s_last_orphan)
+		printk(KERN_INFO "TESTFS: %s: read-only mount, not freeing orphaned inodes\n",
+				sb->s_id);
 	root = testfs_iget(sb, TESTFS_ROOT_INODE(ts));
 	if (IS_ERR(root) || !root) {
 		testfs_debug("Unable to read root inode\n");
@@ -137,10 +531,19 @@ static int testfs_fill_super(struct super_block *sb, void *data, int silent)
 bad_magic:
 	printk("Can't find a valid \"Testfs\" Filesystem on device\n");
 fail1:
+	/* Freeing orphans may have queued a discard */
+	cancel_delayed_work_sync(&tsi->s_discard_work);
+	testfs_stats_exit(sb);
+	brelse(tsi->inode_bitmap);
+	testfs_close_metadev(sb);
+	kfree(metadev);
 	brelse(bh);
 fail:
 	testfs_debug("Something bad happened. Unable to mount\n");
 	sb->s_fs_info = NULL;
+	kfree(tsi->s_discard_map);
+	kfree(tsi->s_orphan_map);
+	kfree(tsi->s_orphan_dirs);
 	kfree(tsi);
 	return -EINVAL;
 }
@@ -190,6 +593,7 @@ static int __init init_testfs(void)
 	int err = 0;
 	err = init_inodecache(); 
 	err += register_filesystem(&testfs_type);
+	testfs_debugfs_init();
 	testfs_debug("Registering testfs\n");
 	return err;
 }
@@ -197,6 +601,7 @@ static int __init init_testfs(void)
 static void __exit exit_testfs(void)
 {
 	testfs_debug("Unregistering testfs\n");
+	testfs_debugfs_exit();
 	destroy_inode_cache();
 	unregister_filesystem(&testfs_type);
 	return;
@@ -12,6 +12,13 @@
 #ifdef __KERNEL__
 #include<linux/types.h>
 #include<linux/magic.h>
+#include<linux/list.h>
+#include<linux/mutex.h>
+#include<linux/spinlock.h>
+#include<linux/workqueue.h>
+#include<linux/ktime.h>
+#include<linux/percpu.h>
+#include<linux/smp.h>
 /*
  * In memory structure of testfs disk inode
  */
@@ -20,13 +27,27 @@ struct testfs_inode_info {
 	__u32 flags;
 	__u32 state;
 	__u32 i_data[1];
+	struct list_head i_lazy_list; /* On s_lazy_inodes if times are deferred */
+	unsigned long i_lazy_since; /* jiffies when the times were first deferred */
 } ;
 #else
+#include<string.h>
 #define __u32 unsigned int
+#define __u64 unsigned long long
 #define __le16 unsigned short
 #define __u8 unsigned char
 #endif
 
+/*
+ * On disk timestamp of testfs. Unlike struct timespec its size doesn't
+ * depend on the architecture the filesystem was created on.
+ */
+struct testfs_timestamp {
+	__u64 tv_sec;
+	__u32 tv_nsec;
+	__u32 pad;
+} ;
+
 /*
  * On disk inode structure of testfs
  */
@@ -36,13 +57,55 @@ struct testfs_inode {
 	__u32 size;
 	__u32 type;
 	__u32 nlinks;
-	struct timespec atime;
-	struct timespec ctime;
-	struct timespec mtime;
 	__u32 data[1];
+	struct testfs_timestamp atime;
+	struct testfs_timestamp ctime;
+	struct testfs_timestamp mtime;
+	__u32 next_orphan; /* Next inode on the orphan list, see s_last_orphan */
+	__u32 generation; /* Tells apart the users of an inode number in NFS handles */
+	__u32 reserved[2]; /* Keep the inode size 8 byte aligned for new fields */
 } ;
 
 #ifdef __KERNEL__
+/*
+ * Counters kept for every mounted testfs
+ */
+enum testfs_stat {
+	TESTFS_STAT_LOOKUPS,		/* testfs_lookup() calls */
+	TESTFS_STAT_NEG_LOOKUPS,	/* lookups which didn't find the name */
+	TESTFS_STAT_DENTRY_SEARCHES,	/* testfs_find_dentry() calls */
+	TESTFS_STAT_DIRENTS_SCANNED,	/* dirents looked at by them */
+	TESTFS_STAT_ALLOCS,		/* inode allocations */
+	TESTFS_STAT_BITMAP_SCANNED,	/* bitmap bytes looked at by them */
+	TESTFS_STAT_SYNC_WRITES,	/* buffers and pages written synchronously */
+	TESTFS_STAT_ITABLE_READS,	/* inode table blocks read from disk */
+	TESTFS_STAT_ORPHANS,		/* inodes put on the orphan list */
+	TESTFS_STAT_ORPHAN_BATCHES,	/* runs of the orphan release worker */
+	TESTFS_NR_STATS
+};
+
+/*
+ * Operations for which we keep a latency histogram
+ */
+enum testfs_lat {
+	TESTFS_LAT_CREATE,
+	TESTFS_LAT_LOOKUP,
+	TESTFS_LAT_UNLINK,
+	TESTFS_LAT_WRITE_INODE,
+	TESTFS_NR_LATS
+};
+
+#define TESTFS_LAT_BUCKETS 32 /* Bucket n counts latencies in [2^n, 2^(n+1)) ns */
+
+/*
+ * The statistics are per cpu so that updating them doesn't bounce
+ * cachelines around, they are summed up only when read from debugfs.
+ */
+struct testfs_stats {
+	u64 count[TESTFS_NR_STATS];
+	u64 lat[TESTFS_NR_LATS][TESTFS_LAT_BUCKETS];
+} ;
+
 /*
  * In memory superblock info of Testfs
  */
@@ -53,17 +116,111 @@ struct testfs_sb_info {
 	__u32 s_free_inodes;
 	__u32 s_max_inodes;
 	__u32 s_first_nonmeta_inode;
+	unsigned long s_mount_opt;
+	struct super_block *s_sb;
+	/* Inodes whose timestamp only updates are deferred by lazytime */
+	struct mutex s_lazy_mutex;
+	struct list_head s_lazy_inodes;
+	struct delayed_work s_lazy_work;
+	spinlock_t s_alloc_lock; /* Protects the inode bitmap and free counts */
+	__u32 s_next_generation; /* i_generation of the next allocated inode */
+	/* Blocks freed but not yet discarded, indexed like the inode bitmap */
+	char *s_discard_map;
+	struct mutex s_discard_mutex;
+	struct delayed_work s_discard_work;
+	/* Unlinked inodes waiting to be freed, indexed like the inode bitmap */
+	char *s_orphan_map;
+	/* Directories with removed entries not yet on disk, like the inode bitmap */
+	char *s_orphan_dirs;
+	unsigned int s_nr_orphans;
+	struct mutex s_orphan_mutex; /* Protects the orphan map and list */
+	struct delayed_work s_orphan_work;
+	/* Device with the bitmap, inode table and directories, if not the main one */
+	struct block_device *s_meta_bdev;
+	fmode_t s_meta_mode;
+	struct testfs_stats *s_stats; /* Per cpu statistics */
+	struct dentry *s_debugfs; /* Our directory in debugfs */
 } ;
+
+/*
+ * Mount flags
+ */
+#define TESTFS_MOUNT_LAZYTIME		0x0001	/* Defer timestamp only updates */
+#define TESTFS_MOUNT_DISCARD		0x0002	/* Discard freed blocks */
+#define TESTFS_MOUNT_NOBH		0x0004	/* No buffer heads for file data */
+
+#define clear_opt(o, opt)		o &= ~TESTFS_MOUNT_##opt
+#define set_opt(o, opt)			o |= TESTFS_MOUNT_##opt
+#define test_opt(sb, opt)		(TESTFS_SB(sb)->s_mount_opt & \
+					 TESTFS_MOUNT_##opt)
+#define testfs_has_feature(sb, f)	(le32_to_cpu(TESTFS_SB(sb)->s_ts->s_features) & \
+					 TESTFS_FEATURE_##f)
+
+/*
+ * Max time for which lazytime keeps timestamp only updates in memory
+ */
+#define TESTFS_LAZYTIME_EXPIRE (12*60*60*HZ)
+
+/*
+ * Time for which freed blocks are batched before being discarded
+ */
+#define TESTFS_DISCARD_DELAY (HZ)
+
+/*
+ * Time for which unlinked inodes are batched before being freed
+ */
+#define TESTFS_ORPHAN_DELAY (HZ/10)
+
+#ifndef FITRIM
+struct fstrim_range {
+	__u64 start;
+	__u64 len;
+	__u64 minlen;
+};
+#define FITRIM		_IOWR('X', 121, struct fstrim_range)	/* Trim */
+#endif
+
+#ifndef FICLONE
+struct file_clone_range {
+	__s64 src_fd;
+	__u64 src_offset;
+	__u64 src_length;
+	__u64 dest_offset;
+};
+#define FICLONE		_IOW(0x94, 9, int)
+#define FICLONERANGE	_IOW(0x94, 13, struct file_clone_range)
+#endif
 #endif
 
+#define TESTFS_LABEL_LEN 16
+
 struct testfs_super_block {
 	__u32 s_magic;
 	__u32 s_blocksize;
 	__u32 s_first_nonmeta_inode;
 	__u32 s_free_inodes;
 	__u32 s_max_inodes;
+	__u32 s_last_orphan; /* Head of the list of unlinked inodes to be freed */
+	__u32 s_features; /* TESTFS_FEATURE_* */
+	__u32 s_meta_id; /* Pairs the filesystem with its metadata device */
+	__u32 s_itable_blocks; /* Inode table size, 0 for TESTFS_INODE_TABLE_BLOCKS */
+	char s_label[TESTFS_LABEL_LEN]; /* Volume label, not NUL terminated if full */
 } ;
 
+/*
+ * Superblock features
+ */
+#define TESTFS_FEATURE_METADEV	0x0001	/* Metadata is on a separate device */
+#define TESTFS_FEATURE_PACKED	0x0002	/* Read-only image built by mktestfs -p */
+
+/*
+ * In a packed image every dirent takes sizeof(struct testfs_dir_entry)
+ * bytes and the size of a directory is the size of its entries. After
+ * "." and ".." the entries are sorted by name, see testfs_namecmp(), so
+ * lookup can do a binary search.
+ */
+#define TESTFS_PACKED_FIRST_DIRENT 2
+
 /*
  * Shamelessly copied from ext2
  */
@@ -94,6 +251,30 @@ static inline __u32 calc_reclen_from_len(unsigned int name_len)
 	return (name_len + (sizeof(struct testfs_dir_entry) - TESTFS_MAX_NAME_LEN) +
 			TESTFS_NAME_ROUND) & ~TESTFS_NAME_ROUND; 
 }
+/*
+ * Does the dirent de hold name
+ */
+static inline int testfs_match(int len, const char *name, struct testfs_dir_entry *de)
+{
+	if (len != de->name_len)
+		return 0;
+	if (!de->inode)
+		return 0;
+	return !memcmp(name, de->name, len);
+}
+
+/*
+ * Order of names in packed directories. Like strcmp() on the names
+ */
+static inline int testfs_namecmp(const char *name, unsigned int len,
+		const char *name2, unsigned int len2)
+{
+	int cmp = memcmp(name, name2, len < len2 ? len : len2);
+	if (cmp)
+		return cmp;
+	return (int)len - (int)len2;
+}
+
 /*
  * File types for testfs
  */
@@ -109,9 +290,50 @@ enum {
 	TESTFS_FT_MAX
 };
 
-#define TESTFS_MAGIC 0x4D4B4653 /* "MKFS" */
+/*
+ * The magic changed when the inode got fixed size timestamps with data[]
+ * moved in front of them. Filesystems with the old inode layout can't be
+ * mounted, they have to be made again.
+ */
+#define TESTFS_MAGIC 0x4D4B4654 /* "MKFT" */
+#define TESTFS_OLD_MAGIC 0x4D4B4653 /* "MKFS" */
+
+/*
+ * Supported block sizes. The kernel can mount only the ones which
+ * are not larger than the page size of the machine.
+ */
+#define TESTFS_MIN_BLOCKSIZE 1024
+#define TESTFS_DFLT_BLOCKSIZE 4096
+#define TESTFS_MAX_BLOCKSIZE 65536
+
+/*
+ * Fixed on disk layout, in units of the filesystem block size
+ */
+#define TESTFS_SUPERBLOCK 1 /* Default blocknumber for superblock */
+#define TESTFS_INODE_BM_BLOCK 2 /* Inode bitmap block number */
+#define TESTFS_INODE_TABLE_BLOCK 3 /* First inode table block */
+#define TESTFS_INODE_TABLE_BLOCKS 3 /* Default, inode table blocks are 3,4 & 5 */
 #define TESTFS_ROOT_INODE(sb) ((sb)->s_first_nonmeta_inode)
 
+/*
+ * Size of the inode table, it ends right before the root directory block.
+ * Filesystems made before mktestfs could size it have 0 in the superblock.
+ */
+#define TESTFS_ITABLE_BLOCKS(ts) \
+	((ts)->s_itable_blocks ? (ts)->s_itable_blocks : TESTFS_INODE_TABLE_BLOCKS)
+
+/*
+ * Most inodes an inode table of itable_blocks can hold. Inodes don't span blocks
+ */
+#define TESTFS_MAX_INODES(blocksize, itable_blocks) \
+	((itable_blocks)*((blocksize)/sizeof(struct testfs_inode)))
+
+/*
+ * Grow a mounted filesystem to the given number of blocks, 0 means
+ * the whole device. Issued on any file or directory of the filesystem.
+ */
+#define TESTFS_IOC_RESIZE_FS _IOW('f', 64, __u64)
+
 #define TESTFS_ISDIR(m)      ((m) & TESTFS_FT_DIR)
 #define TESTFS_ISFILE(m)     ((m) & TESTFS_FT_FILE)
 #define TESTFS_ISSYMLINK(m)  ((m) & TESTFS_FT_SYMLINK)
@@ -151,6 +373,20 @@ enum {
 }
 #endif
 
+/* format.c, shared with the userspace tools */
+extern int testfs_inode_location(struct testfs_super_block *ts, unsigned int ino,
+		unsigned int *block, unsigned int *offset);
+extern unsigned int testfs_find_free_bit(const unsigned char *bitmap, const unsigned char *busy,
+		unsigned int first, unsigned int max, unsigned int *scanned);
+extern int testfs_search_dirents(char *start, char *end, const char *name, unsigned int len,
+		struct testfs_dir_entry **res, unsigned int *scanned);
+extern void testfs_init_dirblock(char *block, unsigned int blocksize, unsigned int ino,
+		unsigned int parent);
+extern int testfs_add_dirent(char *block, unsigned int blocksize, const char *name,
+		unsigned int len, unsigned int ino, unsigned int file_type);
+extern unsigned int testfs_remove_dirent(char *block, unsigned int blocksize, const char *name,
+		unsigned int len);
+
 #ifdef __KERNEL__
 static inline struct testfs_sb_info *TESTFS_SB(struct super_block *sb)
 {
@@ -162,6 +398,36 @@ static inline struct testfs_inode_info *TESTFS_I(struct inode *inode)
 	return container_of(inode, struct testfs_inode_info, vfs_inode);
 }
 
+/*
+ * Nanoseconds elapsed since start. Used for the latencies we report,
+ * a start of 0 gives 0.
+ */
+static inline u64 testfs_elapsed_ns(ktime_t start)
+{
+	if (!ktime_to_ns(start))
+		return 0;
+	return ktime_to_ns(ktime_sub(ktime_get(), start));
+}
+
+/*
+ * Start time for the latency of a tracepoint. The clock is only read
+ * while the event is enabled, so that it costs nothing otherwise.
+ */
+#define testfs_trace_start(event) \
+	(unlikely(__tracepoint_##event.state) ? ktime_get() : ktime_set(0, 0))
+
+static inline void testfs_stat_add(struct super_block *sb, enum testfs_stat stat, u64 val)
+{
+	struct testfs_stats *st = per_cpu_ptr(TESTFS_SB(sb)->s_stats, get_cpu());
+	st->count[stat] += val;
+	put_cpu();
+}
+
+static inline void testfs_stat_inc(struct super_block *sb, enum testfs_stat stat)
+{
+	testfs_stat_add(sb, stat, 1);
+}
+
 /* structure definitions */
 extern const struct inode_operations testfs_file_inode_operations;
 extern const struct inode_operations testfs_dir_inode_operations;
@@ -169,6 +435,7 @@ extern const struct inode_operations testfs_symlink_inode_operations;
 extern const struct file_operations testfs_file_operations;
 extern const struct file_operations testfs_dir_operations;
 extern const struct address_space_operations testfs_aops;
+extern const struct address_space_operations testfs_nobh_aops;
 
 /*
  * Function definitions
@@ -176,20 +443,49 @@ extern const struct address_space_operations testfs_aops;
 extern struct inode *testfs_iget (struct super_block *sb, unsigned int ino);
 extern int testfs_setattr(struct dentry *, struct iattr *);
 extern void testfs_truncate(struct inode *);
-extern int testfs_permission(struct inode *inode, int mask);
 
 /* ialloc.c */
 extern struct inode *testfs_new_inode(struct inode *dir, int mode);
-extern void testfs_free_inode (struct inode *inode);
+extern void testfs_discard_pending(struct super_block *sb);
+extern void testfs_discard_work(struct work_struct *work);
+extern int testfs_trim_fs(struct super_block *sb, struct fstrim_range *range);
+extern int testfs_inode_in_use(struct super_block *sb, unsigned int ino);
+extern void testfs_orphan_add(struct inode *inode);
+extern void testfs_orphan_dir(struct inode *dir);
+extern void testfs_release_orphans(struct super_block *sb);
+extern void testfs_orphan_work(struct work_struct *work);
+extern void testfs_orphan_cleanup(struct super_block *sb);
+
+/* stats.c */
+extern void testfs_stat_latency(struct super_block *sb, enum testfs_lat lat, ktime_t start);
+extern int testfs_stats_init(struct super_block *sb);
+extern void testfs_stats_exit(struct super_block *sb);
+extern void testfs_debugfs_init(void);
+extern void testfs_debugfs_exit(void);
+
+/* ioctl.c */
+extern long testfs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+
+/* super.c */
+extern int testfs_resize_fs(struct super_block *sb, u64 blocks);
+extern struct buffer_head *testfs_meta_bread(struct super_block *sb, sector_t block);
+extern struct buffer_head *testfs_meta_getblk(struct super_block *sb, sector_t block);
 
 /* inode.c */
 int __testfs_write_begin(struct file *file, struct address_space *mapping,
 		loff_t pos, unsigned len, unsigned flags, struct page **pagep,
 		void **fsdata);
+struct testfs_inode *testfs_get_inode(struct super_block *sb, unsigned int ino,
+				struct buffer_head **bhp);
 int testfs_write_inode(struct inode *inode, int wait);
 void testfs_delete_inode(struct inode *inode);
+void testfs_clear_inode(struct inode *inode);
+void testfs_flush_lazy_inodes(struct super_block *sb, int all);
+void testfs_lazytime_work(struct work_struct *work);
 /* dir.c */
 extern unsigned int testfs_inode_by_name(struct inode *dir, struct qstr *child);
+/* namei.c */
+extern struct dentry *testfs_get_parent(struct dentry *child);
 extern int testfs_add_link(struct dentry *, struct inode *);
 struct testfs_dir_entry *testfs_find_dentry(struct inode *dir,
 	          struct qstr *child, struct page **respage);
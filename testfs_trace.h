@@ -0,0 +1,237 @@
+/***********************************************************/
+/*  This is the readme for the testfs filesystem           */
+/*  Author : Manish Katiyar <mkatiyar@gmail.com>           */
+/*  Description : A simple disk based filesystem for linux */
+/*  Date   : 08/01/09                                      */
+/*  Version : 0.01                                         */
+/*  Distributed under GPL                                  */
+/***********************************************************/
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM testfs
+
+#if !defined(_TRACE_TESTFS_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_TESTFS_H
+
+#include<linux/tracepoint.h>
+
+/*
+ * Tracepoints of testfs. They can be enabled at runtime from
+ * /sys/kernel/debug/tracing/events/testfs/ or with perf. Latencies
+ * are in nanoseconds.
+ */
+TRACE_EVENT(testfs_new_inode,
+	TP_PROTO(struct inode *dir, unsigned int ino, int mode,
+		 unsigned int scanned, u64 latency),
+
+	TP_ARGS(dir, ino, mode, scanned, latency),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(ino_t, dir)
+		__field(unsigned int, ino)
+		__field(int, mode)
+		__field(unsigned int, scanned)
+		__field(u64, latency)
+	),
+
+	TP_fast_assign(
+		__entry->dev = dir->i_sb->s_dev;
+		__entry->dir = dir->i_ino;
+		__entry->ino = ino;
+		__entry->mode = mode;
+		__entry->scanned = scanned;
+		__entry->latency = latency;
+	),
+
+	TP_printk("dev %d,%d dir %lu ino %u mode 0%o bitmap bytes scanned %u latency %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), (unsigned long)__entry->dir,
+		  __entry->ino, __entry->mode, __entry->scanned,
+		  (unsigned long long)__entry->latency)
+);
+
+TRACE_EVENT(testfs_free_inode,
+	TP_PROTO(struct super_block *sb, unsigned int ino, unsigned int block),
+
+	TP_ARGS(sb, ino, block),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned int, ino)
+		__field(unsigned int, block)
+	),
+
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->ino = ino;
+		__entry->block = block;
+	),
+
+	TP_printk("dev %d,%d ino %u block %u",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->ino, __entry->block)
+);
+
+TRACE_EVENT(testfs_find_dentry,
+	TP_PROTO(struct inode *dir, struct qstr *name, unsigned int ino,
+		 unsigned int scanned, u64 latency),
+
+	TP_ARGS(dir, name, ino, scanned, latency),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(ino_t, dir)
+		__array(char, name, TESTFS_MAX_NAME_LEN + 1)
+		__field(unsigned int, ino)
+		__field(unsigned int, scanned)
+		__field(u64, latency)
+	),
+
+	TP_fast_assign(
+		__entry->dev = dir->i_sb->s_dev;
+		__entry->dir = dir->i_ino;
+		memset(__entry->name, 0, TESTFS_MAX_NAME_LEN + 1);
+		memcpy(__entry->name, name->name,
+		       min_t(unsigned int, name->len, TESTFS_MAX_NAME_LEN));
+		__entry->ino = ino;
+		__entry->scanned = scanned;
+		__entry->latency = latency;
+	),
+
+	TP_printk("dev %d,%d dir %lu name %s ino %u dirents scanned %u latency %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), (unsigned long)__entry->dir,
+		  __entry->name, __entry->ino, __entry->scanned,
+		  (unsigned long long)__entry->latency)
+);
+
+TRACE_EVENT(testfs_add_link,
+	TP_PROTO(struct inode *dir, struct qstr *name, unsigned int ino,
+		 unsigned int scanned, int err, u64 latency),
+
+	TP_ARGS(dir, name, ino, scanned, err, latency),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(ino_t, dir)
+		__array(char, name, TESTFS_MAX_NAME_LEN + 1)
+		__field(unsigned int, ino)
+		__field(unsigned int, scanned)
+		__field(int, err)
+		__field(u64, latency)
+	),
+
+	TP_fast_assign(
+		__entry->dev = dir->i_sb->s_dev;
+		__entry->dir = dir->i_ino;
+		memset(__entry->name, 0, TESTFS_MAX_NAME_LEN + 1);
+		memcpy(__entry->name, name->name,
+		       min_t(unsigned int, name->len, TESTFS_MAX_NAME_LEN));
+		__entry->ino = ino;
+		__entry->scanned = scanned;
+		__entry->err = err;
+		__entry->latency = latency;
+	),
+
+	TP_printk("dev %d,%d dir %lu name %s ino %u dirents scanned %u err %d latency %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), (unsigned long)__entry->dir,
+		  __entry->name, __entry->ino, __entry->scanned, __entry->err,
+		  (unsigned long long)__entry->latency)
+);
+
+TRACE_EVENT(testfs_get_blocks,
+	TP_PROTO(struct inode *inode, sector_t block, unsigned long maxblocks,
+		 sector_t pblock, int err, int create),
+
+	TP_ARGS(inode, block, maxblocks, pblock, err, create),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(ino_t, ino)
+		__field(sector_t, block)
+		__field(unsigned long, maxblocks)
+		__field(sector_t, pblock)
+		__field(int, err)	/* blocks mapped or -errno */
+		__field(int, create)
+	),
+
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->block = block;
+		__entry->maxblocks = maxblocks;
+		__entry->pblock = pblock;
+		__entry->err = err;
+		__entry->create = create;
+	),
+
+	TP_printk("dev %d,%d ino %lu block %llu maxblocks %lu pblock %llu err %d create %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), (unsigned long)__entry->ino,
+		  (unsigned long long)__entry->block, __entry->maxblocks,
+		  (unsigned long long)__entry->pblock, __entry->err, __entry->create)
+);
+
+TRACE_EVENT(testfs_update_inode,
+	TP_PROTO(struct inode *inode, int sync, int deferred, int err, u64 latency),
+
+	TP_ARGS(inode, sync, deferred, err, latency),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(ino_t, ino)
+		__field(int, sync)
+		__field(int, deferred)
+		__field(int, err)
+		__field(u64, latency)
+	),
+
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->sync = sync;
+		__entry->deferred = deferred;
+		__entry->err = err;
+		__entry->latency = latency;
+	),
+
+	TP_printk("dev %d,%d ino %lu sync %d deferred %d err %d latency %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), (unsigned long)__entry->ino,
+		  __entry->sync, __entry->deferred, __entry->err,
+		  (unsigned long long)__entry->latency)
+);
+
+TRACE_EVENT(testfs_readdir,
+	TP_PROTO(struct inode *dir, loff_t pos, unsigned int emitted, int err, u64 latency),
+
+	TP_ARGS(dir, pos, emitted, err, latency),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(ino_t, dir)
+		__field(loff_t, pos)
+		__field(unsigned int, emitted)
+		__field(int, err)
+		__field(u64, latency)
+	),
+
+	TP_fast_assign(
+		__entry->dev = dir->i_sb->s_dev;
+		__entry->dir = dir->i_ino;
+		__entry->pos = pos;
+		__entry->emitted = emitted;
+		__entry->err = err;
+		__entry->latency = latency;
+	),
+
+	TP_printk("dev %d,%d dir %lu pos %lld entries %u err %d latency %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), (unsigned long)__entry->dir,
+		  __entry->pos, __entry->emitted, __entry->err,
+		  (unsigned long long)__entry->latency)
+);
+
+#endif /* _TRACE_TESTFS_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE testfs_trace
+#include <trace/define_trace.h>
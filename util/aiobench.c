@@ -0,0 +1,249 @@
+/***********************************************************/
+/*  Author : Manish Katiyar <mkatiyar@gmail.com>           */
+/*  Description : A simple disk based filesystem for linux */
+/*  Date   : 08/01/09                                      */
+/*  Version : 0.01                                         */
+/*  Distributed under GPL                                  */
+/***********************************************************/
+
+/*
+ * Measure how testfs behaves with native Linux AIO. For every io_submit()
+ * we record how long the submitting thread was held up; an I/O which can
+ * be queued without blocking returns from io_submit() in microseconds.
+ *
+ * Run it against files on a loop mounted testfs image, eg.
+ *	aiobench -d -q 32 -n 100000 mnt/file1 mnt/file2
+ */
+#define _GNU_SOURCE
+#include<stdio.h>
+#include<stdlib.h>
+#include<fcntl.h>
+#include<string.h>
+#include<unistd.h>
+#include<errno.h>
+#include<time.h>
+#include<sys/stat.h>
+#include<sys/syscall.h>
+#include<linux/aio_abi.h>
+
+#define AIOBENCH_TOOL "aiobench"
+#define AIOBENCH_VERSION "1.0.0"
+#define MAX_FILES 64
+#define NR_BUCKETS 32
+
+char *progname;
+
+static void usage()
+{
+	fprintf(stderr,"%s (version %s) - AIO submission latency benchmark\n",
+			AIOBENCH_TOOL, AIOBENCH_VERSION);
+	fprintf(stderr,"Usage : %s [-d] [-w] [-q depth] [-n ios] [-s iosize] file...\n", progname);
+	fprintf(stderr,"\t-d : Open the files with O_DIRECT\n");
+	fprintf(stderr,"\t-w : Write instead of read\n");
+	fprintf(stderr,"\t-q : Number of I/Os kept in flight (default 16)\n");
+	fprintf(stderr,"\t-n : Total number of I/Os (default 10000)\n");
+	fprintf(stderr,"\t-s : Size of each I/O (default 4096)\n");
+	return;
+}
+
+static inline int io_setup(unsigned nr, aio_context_t *ctx)
+{
+	return syscall(__NR_io_setup, nr, ctx);
+}
+
+static inline int io_destroy(aio_context_t ctx)
+{
+	return syscall(__NR_io_destroy, ctx);
+}
+
+static inline int io_submit(aio_context_t ctx, long nr, struct iocb **iocbpp)
+{
+	return syscall(__NR_io_submit, ctx, nr, iocbpp);
+}
+
+static inline int io_getevents(aio_context_t ctx, long min_nr, long nr,
+		struct io_event *events, struct timespec *timeout)
+{
+	return syscall(__NR_io_getevents, ctx, min_nr, nr, events, timeout);
+}
+
+static inline unsigned long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * log2 histogram of the time spent in io_submit()
+ */
+static unsigned long long hist[NR_BUCKETS];
+
+static void account(unsigned long long ns)
+{
+	int b = 0;
+	while (ns > 1 && b < NR_BUCKETS - 1) {
+		ns >>= 1;
+		b++;
+	}
+	hist[b]++;
+}
+
+static unsigned long long percentile(unsigned long long total, double pct)
+{
+	unsigned long long seen = 0;
+	int b;
+	for (b = 0; b < NR_BUCKETS; b++) {
+		seen += hist[b];
+		if (seen >= total*pct)
+			return 2ULL << b;
+	}
+	return 2ULL << (NR_BUCKETS - 1);
+}
+
+int main(int argc, char **argv)
+{
+	int fds[MAX_FILES];
+	off_t sizes[MAX_FILES];
+	int nfiles = 0, direct = 0, write_io = 0;
+	unsigned int depth = 16, iosize = 4096;
+	unsigned long long nios = 10000, submitted = 0, completed = 0;
+	unsigned long long start, elapsed, submit_ns = 0;
+	aio_context_t ctx = 0;
+	struct iocb *iocbs, **iocbp;
+	struct io_event *events;
+	unsigned int *free_slots, nfree;
+	char *bufs;
+	int c, i;
+
+	progname = argv[0];
+	while ((c = getopt(argc, argv, "dwq:n:s:h")) != -1) {
+		switch (c) {
+		case 'd':
+			direct = 1;
+			break;
+		case 'w':
+			write_io = 1;
+			break;
+		case 'q':
+			depth = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			nios = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			iosize = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+			exit(-1);
+		}
+	}
+	if (optind >= argc || !depth || !iosize || !nios) {
+		usage();
+		exit(-1);
+	}
+	if (argc - optind > MAX_FILES) {
+		fprintf(stderr, "At most %d files can be used\n", MAX_FILES);
+		exit(-1);
+	}
+
+	for (i = optind; i < argc; i++, nfiles++) {
+		struct stat st;
+		fds[nfiles] = open(argv[i], (write_io ? O_RDWR : O_RDONLY) | (direct ? O_DIRECT : 0));
+		if (fds[nfiles] == -1 || fstat(fds[nfiles], &st) == -1) {
+			perror(argv[i]);
+			exit(-1);
+		}
+		/* testfs files are at most a block, stay within them */
+		sizes[nfiles] = st.st_size < iosize ? iosize : st.st_size;
+	}
+
+	iocbs = calloc(depth, sizeof(*iocbs));
+	iocbp = calloc(depth, sizeof(*iocbp));
+	events = calloc(depth, sizeof(*events));
+	free_slots = calloc(depth, sizeof(*free_slots));
+	if (!iocbs || !iocbp || !events || !free_slots ||
+			posix_memalign((void **)&bufs, 4096, (size_t)depth*iosize)) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		exit(-1);
+	}
+	memset(bufs, 0x5a, (size_t)depth*iosize);
+	/* An iocb and its buffer are reused only once their I/O completed */
+	for (nfree = 0; nfree < depth; nfree++)
+		free_slots[nfree] = depth - 1 - nfree;
+	if (io_setup(depth, &ctx) == -1) {
+		perror("io_setup ");
+		exit(-1);
+	}
+
+	start = now_ns();
+	while (completed < nios) {
+		int n = 0, got;
+
+		/* Keep the queue full */
+		while (nfree && submitted + n < nios) {
+			unsigned int slot = free_slots[--nfree];
+			int f = (submitted + n) % nfiles;
+			struct iocb *cb = &iocbs[slot];
+			off_t blocks = sizes[f]/iosize;
+
+			memset(cb, 0, sizeof(*cb));
+			cb->aio_fildes = fds[f];
+			cb->aio_lio_opcode = write_io ? IOCB_CMD_PWRITE : IOCB_CMD_PREAD;
+			cb->aio_buf = (unsigned long)(bufs + (size_t)slot*iosize);
+			cb->aio_nbytes = iosize;
+			cb->aio_offset = (off_t)(random() % blocks) * iosize;
+			cb->aio_data = slot;
+			iocbp[n++] = cb;
+		}
+		if (n) {
+			unsigned long long t = now_ns();
+			int ret = io_submit(ctx, n, iocbp);
+			t = now_ns() - t;
+			if (ret < 0) {
+				perror("io_submit ");
+				exit(-1);
+			}
+			submit_ns += t;
+			for (i = 0; i < ret; i++)
+				account(t/ret);
+			submitted += ret;
+			/* Take back the slots of the I/Os which weren't queued */
+			for (i = ret; i < n; i++)
+				free_slots[nfree++] = iocbp[i]->aio_data;
+		}
+
+		got = io_getevents(ctx, 1, depth, events, NULL);
+		if (got < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("io_getevents ");
+			exit(-1);
+		}
+		for (i = 0; i < got; i++) {
+			if ((long long)events[i].res < 0) {
+				fprintf(stderr, "I/O failed : %s\n", strerror(-events[i].res));
+				exit(-1);
+			}
+			free_slots[nfree++] = events[i].data;
+		}
+		completed += got;
+	}
+	elapsed = now_ns() - start;
+
+	printf("%s %s, depth %u, iosize %u, %d files\n", write_io ? "write" : "read",
+			direct ? "O_DIRECT" : "buffered", depth, iosize, nfiles);
+	printf("ios        : %llu in %.3f s (%.0f IOPS, %.2f MB/s)\n", completed,
+			elapsed/1e9, completed/(elapsed/1e9),
+			completed*(double)iosize/(elapsed/1e3));
+	printf("io_submit  : avg %.2f us, p50 < %.2f us, p99 < %.2f us, p99.9 < %.2f us per I/O\n",
+			submit_ns/1e3/submitted,
+			percentile(submitted, 0.50)/1e3, percentile(submitted, 0.99)/1e3,
+			percentile(submitted, 0.999)/1e3);
+
+	io_destroy(ctx);
+	for (i = 0; i < nfiles; i++)
+		close(fds[i]);
+	return 0;
+}
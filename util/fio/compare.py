@@ -0,0 +1,126 @@
+#!/usr/bin/env python3
+#
+# Summarise the fio output written by run.sh and compare it against a
+# baseline summary. Exits 1 if a metric regressed by more than the
+# threshold, 2 on bad input.
+#
+import argparse
+import glob
+import json
+import os
+import sys
+
+# metric -> True if bigger is better
+METRICS = {
+    'bw_kib': True,
+    'iops': True,
+    'lat_p50_us': False,
+    'lat_p99_us': False,
+    'lat_p999_us': False,
+}
+PERCENTILES = {
+    'lat_p50_us': '50.000000',
+    'lat_p99_us': '99.000000',
+    'lat_p999_us': '99.900000',
+}
+
+
+def summarise_dir(stats):
+    """Bandwidth, iops and completion latency of one direction of a job"""
+    s = {'bw_kib': stats['bw'], 'iops': round(stats['iops'], 1)}
+    pct = stats.get('clat_ns', {}).get('percentile', {})
+    for metric, key in PERCENTILES.items():
+        s[metric] = round(pct.get(key, 0) / 1000.0, 1)
+    return s
+
+
+def summarise(outdir):
+    """Profile name -> direction -> metrics, for every fio output in outdir"""
+    summary = {}
+    for path in sorted(glob.glob(os.path.join(outdir, '*.json'))):
+        name = os.path.basename(path)[:-len('.json')]
+        if name == 'summary':
+            continue
+        with open(path) as f:
+            job = json.load(f)['jobs'][0]  # profiles use group_reporting
+        result = {}
+        for d in ('read', 'write'):
+            if job[d]['io_bytes']:
+                result[d] = summarise_dir(job[d])
+        if job.get('sync', {}).get('total_ios'):
+            pct = job['sync']['lat_ns'].get('percentile', {})
+            result['fsync'] = {m: round(pct.get(k, 0) / 1000.0, 1)
+                               for m, k in PERCENTILES.items()}
+        summary[name] = result
+    return summary
+
+
+def compare(summary, baseline, threshold):
+    """Print the changes against baseline, return the number of regressions"""
+    regressions = 0
+    print('%-28s %-6s %-12s %12s %12s %8s' %
+          ('profile', 'dir', 'metric', 'baseline', 'current', 'change'))
+    for name in sorted(summary):
+        if name not in baseline:
+            print('%-28s (not in baseline)' % name)
+            continue
+        for d in sorted(summary[name]):
+            for metric, value in sorted(summary[name][d].items()):
+                old = baseline[name].get(d, {}).get(metric)
+                if not old:
+                    continue
+                change = (value - old) * 100.0 / old
+                worse = -change if METRICS[metric] else change
+                flag = ''
+                if worse > threshold:
+                    flag = '  REGRESSION'
+                    regressions += 1
+                print('%-28s %-6s %-12s %12.1f %12.1f %+7.1f%%%s' %
+                      (name, d, metric, old, value, change, flag))
+    return regressions
+
+
+def main():
+    p = argparse.ArgumentParser(description=__doc__)
+    p.add_argument('outdir', help='directory with the fio json output')
+    p.add_argument('-b', dest='baseline', help='baseline summary to compare against')
+    p.add_argument('-t', dest='threshold', type=float, default=10.0,
+                   help='regression threshold in percent (default 10)')
+    p.add_argument('-s', dest='save', help='save the summary as a new baseline')
+    args = p.parse_args()
+
+    try:
+        summary = summarise(args.outdir)
+    except (OSError, ValueError, KeyError, IndexError) as e:
+        print('%s: bad fio output in %s: %s' % (sys.argv[0], args.outdir, e),
+              file=sys.stderr)
+        return 2
+    if not summary:
+        print('%s: no fio output in %s' % (sys.argv[0], args.outdir), file=sys.stderr)
+        return 2
+
+    text = json.dumps(summary, indent=2, sort_keys=True) + '\n'
+    with open(os.path.join(args.outdir, 'summary.json'), 'w') as f:
+        f.write(text)
+    if args.save:
+        with open(args.save, 'w') as f:
+            f.write(text)
+
+    if not args.baseline:
+        sys.stdout.write(text)
+        return 0
+    try:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+    except (OSError, ValueError) as e:
+        print('%s: %s: %s' % (sys.argv[0], args.baseline, e), file=sys.stderr)
+        return 2
+    regressions = compare(summary, baseline, args.threshold)
+    if regressions:
+        print('%d metrics regressed by more than %g%%' % (regressions, args.threshold))
+        return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,156 @@
+#!/bin/bash
+#
+# Data path benchmark : make a testfs image, mount it and run the fio
+# profiles in this directory against it. Results are summarised and
+# compared against a baseline by compare.py, see the README.
+#
+here=$(cd "$(dirname "$0")" && pwd)
+util=$(dirname "$here")
+progname=$(basename "$0")
+
+mode=module
+size=64M
+blocksize=4096
+runtime=10
+threshold=10
+outdir=fio-results
+baseline=
+save=
+
+usage()
+{
+	cat >&2 <<EOF
+usage: $progname [options] [profile.fio ...]
+  -m module|fuse  mount with the kernel module (default, needs root) or testfs-fuse
+  -s size         image size (default $size)
+  -b blocksize    filesystem blocksize (default $blocksize)
+  -r seconds      runtime of each profile (default $runtime)
+  -o dir          where the fio output and summary.json go (default $outdir)
+  -B file         baseline summary to compare against
+  -t percent      regression threshold (default $threshold)
+  -S file         save this run's summary as a new baseline
+Without profiles all *.fio files in $here are run.
+EOF
+	exit 1
+}
+
+die()
+{
+	echo "$progname: $*" >&2
+	exit 1
+}
+
+while getopts "m:s:b:r:o:B:t:S:h" opt; do
+	case $opt in
+	m) mode=$OPTARG ;;
+	s) size=$OPTARG ;;
+	b) blocksize=$OPTARG ;;
+	r) runtime=$OPTARG ;;
+	o) outdir=$OPTARG ;;
+	B) baseline=$OPTARG ;;
+	t) threshold=$OPTARG ;;
+	S) save=$OPTARG ;;
+	*) usage ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+profiles=("$@")
+[ ${#profiles[@]} -eq 0 ] && profiles=("$here"/*.fio)
+
+command -v fio >/dev/null || die "fio not found"
+command -v python3 >/dev/null || die "python3 not found"
+[ -x "$util/mktestfs" ] || die "build the tools first with make -C $util"
+case $mode in
+module)
+	[ $(id -u) -eq 0 ] || die "-m module needs root"
+	grep -qw testfs /proc/filesystems || die "the testfs module is not loaded"
+	;;
+fuse)
+	[ -x "$util/testfs-fuse" ] || die "testfs-fuse is not built"
+	;;
+*)
+	usage
+	;;
+esac
+
+work=$(mktemp -d) || exit 1
+image=$work/image
+mnt=$work/mnt
+mounted=
+
+# fusermount3 comes with libfuse, but root can do without it
+unmount()
+{
+	if [ $mode = fuse ] && command -v fusermount3 >/dev/null; then
+		fusermount3 -u "$mnt"
+	else
+		umount "$mnt"
+	fi
+}
+
+cleanup()
+{
+	[ -n "$mounted" ] && unmount
+	rm -rf "$work"
+}
+trap cleanup EXIT
+
+mkdir -p "$mnt" "$outdir" || exit 1
+
+#
+# Every file is one block and fio's files are counted against the inode
+# table, so give the image enough inodes. Each profile gets a fresh
+# filesystem so runs don't see each other's layout.
+#
+fresh_fs()
+{
+	if [ -n "$mounted" ]; then
+		unmount
+		mounted=
+	fi
+	rm -f "$image"
+	truncate -s "$size" "$image" || return 1
+	"$util/mktestfs" -b "$blocksize" -N 1024 "$image" >/dev/null || return 1
+	if [ $mode = fuse ]; then
+		"$util/testfs-fuse" "$image" "$mnt" || return 1
+	else
+		mount -t testfs -o loop "$image" "$mnt" || return 1
+	fi
+	mounted=1
+}
+
+#
+# The profiles run two jobs, whose files all go in the root directory.
+# It is one block too and a dirent for fio's short names takes 24 bytes.
+#
+nrfiles=$(( (blocksize / 24 - 2) / 2 ))
+[ $nrfiles -gt 64 ] && nrfiles=64
+
+# A profile which fails doesn't stop the others, but fails the run
+failed=
+for profile in "${profiles[@]}"; do
+	name=$(basename "$profile" .fio)
+	fresh_fs || die "could not set up the filesystem for $name"
+	echo "$name" >&2
+	rm -f "$outdir/$name.json"
+	if ! TESTFS_MNT=$mnt TESTFS_BS=$blocksize TESTFS_NRFILES=$nrfiles \
+		TESTFS_RUNTIME=$runtime fio --output-format=json \
+		--percentile_list=50:99:99.9 --output="$outdir/$name.json" \
+		"$profile"; then
+		echo "$progname: fio failed on $name" >&2
+		rm -f "$outdir/$name.json"
+		failed="$failed $name"
+	fi
+done
+
+# Don't save a baseline with profiles missing
+if [ -n "$failed" ] && [ -n "$save" ]; then
+	echo "$progname: not saving $save" >&2
+	save=
+fi
+python3 "$here/compare.py" -t "$threshold" ${baseline:+-b "$baseline"} \
+	${save:+-s "$save"} "$outdir"
+ret=$?
+[ -n "$failed" ] && die "failed profiles:$failed"
+exit $ret
@@ -0,0 +1,632 @@
+/***********************************************************/
+/*  Author : Manish Katiyar <mkatiyar@gmail.com>           */
+/*  Description : A simple disk based filesystem for linux */
+/*  Date   : 08/01/09                                      */
+/*  Version : 0.01                                         */
+/*  Distributed under GPL                                  */
+/***********************************************************/
+
+/*
+ * Check (and repair) an unmounted testfs image. The image is mmapped and
+ * checked in passes :
+ *	1. inode table : type, size and block of every allocated inode
+ *	2. directories : rec_len chains and the inodes the entries point at
+ *	3. walk of the tree from the root, counting the references to every
+ *	   inode from the directories which can be reached
+ *	4. link counts, unattached inodes, the bitmap and the free count
+ * Passes 1 and 2 are spread over threads.
+ */
+#define _GNU_SOURCE
+#include<stdio.h>
+#include<stdlib.h>
+#include<fcntl.h>
+#include<string.h>
+#include<unistd.h>
+#include<errno.h>
+#include<time.h>
+#include<stdarg.h>
+#include<pthread.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<sys/types.h>
+#include "../testfs.h"
+
+#define FSCK_TOOL "fsck.testfs"
+#define FSCK_VERSION "1.0.0"
+#define MAX_THREADS 64
+#define INODE_CHUNK 64 /* Inodes handed to a thread at a time in pass 1 */
+
+/* Exit codes, same as the other fsck tools */
+#define FSCK_OK 0
+#define FSCK_FIXED 1
+#define FSCK_UNCORRECTED 4
+#define FSCK_ERROR 8
+
+/* What pass 1 found an inode to be */
+enum {
+	INODE_FREE,
+	INODE_FILE,	/* Regular file or symlink */
+	INODE_DIR,
+	INODE_BAD,	/* Allocated but of no type we know */
+};
+
+/*
+ * State of the check
+ */
+struct fsck {
+	char *meta;		/* Image with the bitmap, inode table and directories */
+	size_t meta_size;
+	struct testfs_super_block *sb;
+	unsigned int bs;
+	unsigned int first;	/* Root inode */
+	unsigned int max;
+	unsigned char *bitmap;
+	unsigned char *state;	/* INODE_* for every inode */
+	unsigned char *orphan;	/* Inodes on the orphan list */
+	unsigned int *refs;	/* Entries of reachable directories pointing at every inode */
+	unsigned int *named;	/* Same, leaving out "." and ".." */
+	unsigned int *dirs;	/* Allocated directories, for pass 2 */
+	unsigned int nr_dirs;
+	unsigned int next;	/* Work shared by the threads of a pass */
+	unsigned long dirents;
+	unsigned long errors, fixed;
+	int fix;
+	pthread_mutex_t lock;
+};
+
+static struct fsck fs;
+char *progname;
+
+static void usage()
+{
+	fprintf(stderr,"%s (version %s) - Check a testfs filesystem\n",
+			FSCK_TOOL, FSCK_VERSION);
+	fprintf(stderr,"Usage : %s [-n|-y] [-j threads] [-t] [-m metadev] device\n", progname);
+	fprintf(stderr,"\t-n : Only report problems (default)\n");
+	fprintf(stderr,"\t-y : Repair the problems found\n");
+	fprintf(stderr,"\t-j : Number of threads (default number of cpus)\n");
+	fprintf(stderr,"\t-t : Report the time taken by every pass\n");
+	fprintf(stderr,"\t-m : Metadata device of the filesystem, see mktestfs -m\n");
+	return;
+}
+
+/*
+ * Report a problem which we know how to repair. Returns true if it
+ * should be repaired.
+ */
+static int problem(const char *fmt, ...)
+{
+	va_list ap;
+
+	pthread_mutex_lock(&fs.lock);
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	if (fs.fix) {
+		printf(" : fixed\n");
+		fs.fixed++;
+	} else {
+		printf("\n");
+		fs.errors++;
+	}
+	pthread_mutex_unlock(&fs.lock);
+	return fs.fix;
+}
+
+/*
+ * Report a problem we can't repair
+ */
+static void unfixable(const char *fmt, ...)
+{
+	va_list ap;
+
+	pthread_mutex_lock(&fs.lock);
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf("\n");
+	fs.errors++;
+	pthread_mutex_unlock(&fs.lock);
+}
+
+static inline int test_bit(unsigned char *map, unsigned int nr)
+{
+	return map[nr/8] & (1 << (nr%8));
+}
+
+static inline void clear_bit(unsigned char *map, unsigned int nr)
+{
+	map[nr/8] &= ~(1 << (nr%8));
+}
+
+static inline int valid_inode(unsigned int ino)
+{
+	return ino >= fs.first && ino < fs.max;
+}
+
+static struct testfs_inode *get_inode(unsigned int ino)
+{
+	unsigned int block, offset;
+
+	/* check_superblock() made sure all inodes are in the table */
+	testfs_inode_location(fs.sb, ino, &block, &offset);
+	return (struct testfs_inode *)(fs.meta + (size_t)block*fs.bs + offset);
+}
+
+static inline double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static char *map_device(char *device, size_t *size)
+{
+	struct stat st;
+	char *map;
+	int fd = open(device, fs.fix ? O_RDWR : O_RDONLY);
+
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		perror(device);
+		exit(FSCK_ERROR);
+	}
+	*size = S_ISBLK(st.st_mode) ? lseek(fd, 0, SEEK_END) : st.st_size;
+	map = mmap(NULL, *size, PROT_READ | (fs.fix ? PROT_WRITE : 0), MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("Unable to mmap device ");
+		exit(FSCK_ERROR);
+	}
+	close(fd);
+	return map;
+}
+
+/*
+ * Find the superblock the way the kernel does, by trying every blocksize
+ */
+static struct testfs_super_block *find_superblock(char *map, size_t size)
+{
+	struct testfs_super_block *sb;
+	unsigned int bs;
+
+	for (bs = TESTFS_MIN_BLOCKSIZE; bs <= TESTFS_MAX_BLOCKSIZE; bs <<= 1) {
+		if ((TESTFS_SUPERBLOCK + 1)*(size_t)bs > size)
+			break;
+		sb = (struct testfs_super_block *)(map + TESTFS_SUPERBLOCK*(size_t)bs);
+		if (sb->s_magic == TESTFS_MAGIC && sb->s_blocksize == bs)
+			return sb;
+	}
+	return NULL;
+}
+
+static void check_superblock(char *device, char *metadev)
+{
+	struct testfs_super_block *sb = fs.sb;
+
+	fs.bs = sb->s_blocksize;
+	fs.first = sb->s_first_nonmeta_inode;
+	fs.max = sb->s_max_inodes;
+	if (sb->s_features & TESTFS_FEATURE_METADEV) {
+		struct testfs_super_block *msb;
+		if (!metadev) {
+			fprintf(stderr, "%s has its metadata on another device, give it with -m\n", device);
+			exit(FSCK_ERROR);
+		}
+		fs.meta = map_device(metadev, &fs.meta_size);
+		msb = find_superblock(fs.meta, fs.meta_size);
+		if (!msb || msb->s_meta_id != sb->s_meta_id) {
+			fprintf(stderr, "%s is not the metadata device of %s\n", metadev, device);
+			exit(FSCK_ERROR);
+		}
+	}
+
+	if (fs.first < TESTFS_INODE_TABLE_BLOCK + TESTFS_ITABLE_BLOCKS(sb) ||
+			fs.max <= fs.first || fs.max > TESTFS_MAX_INODES(fs.bs, TESTFS_ITABLE_BLOCKS(sb)) ||
+			fs.max > fs.bs*8 ||
+			(size_t)fs.max*fs.bs > fs.meta_size) {
+		fprintf(stderr, "Superblock is corrupt : first inode %u, max inodes %u, blocksize %u\n",
+				fs.first, fs.max, fs.bs);
+		exit(FSCK_UNCORRECTED);
+	}
+	fs.bitmap = (unsigned char *)fs.meta + TESTFS_INODE_BM_BLOCK*(size_t)fs.bs;
+}
+
+/*
+ * Pass 1 : inode table
+ */
+static void check_inode(unsigned int ino)
+{
+	struct testfs_inode *raw = get_inode(ino);
+
+	if (!test_bit(fs.bitmap, ino)) {
+		fs.state[ino] = INODE_FREE;
+		return;
+	}
+	if (S_ISDIR(raw->type))
+		fs.state[ino] = INODE_DIR;
+	else if (S_ISREG(raw->type) || S_ISLNK(raw->type))
+		fs.state[ino] = INODE_FILE;
+	else {
+		fs.state[ino] = INODE_BAD;
+		return;
+	}
+	/* Blocks and inodes have 1:1 correspondence */
+	if (raw->data[0] != ino &&
+			problem("Inode %u points at block %u", ino, raw->data[0]))
+		raw->data[0] = ino;
+	if (raw->size > fs.bs &&
+			problem("Inode %u has size %u, larger than a block", ino, raw->size))
+		raw->size = fs.bs;
+}
+
+static void *pass1_worker(void *arg)
+{
+	unsigned int ino, end;
+
+	while ((ino = __sync_fetch_and_add(&fs.next, INODE_CHUNK)) < fs.max) {
+		end = ino + INODE_CHUNK < fs.max ? ino + INODE_CHUNK : fs.max;
+		for (; ino < end; ino++)
+			check_inode(ino);
+	}
+	return NULL;
+}
+
+/*
+ * Can the entry at off of a directory of size bytes be followed?
+ */
+static int sane_entry(struct testfs_dir_entry *de, unsigned int off, unsigned int size)
+{
+	if (!de->rec_len || (de->rec_len & TESTFS_NAME_ROUND) ||
+			off + de->rec_len > size || de->name_len > TESTFS_MAX_NAME_LEN)
+		return 0;
+	return !de->inode || (de->name_len && de->rec_len >= calc_rec_len(de));
+}
+
+static int sane_chain(char *blk, unsigned int off, unsigned int size)
+{
+	struct testfs_dir_entry *de;
+	unsigned int hdr = sizeof(*de) - TESTFS_MAX_NAME_LEN;
+
+	for (; off + hdr <= size; off += de->rec_len) {
+		de = (struct testfs_dir_entry *)(blk + off);
+		if (!sane_entry(de, off, size))
+			return 0;
+	}
+	return off == size;
+}
+
+/*
+ * Where the entry at off of a directory ends. For a bad entry that's the
+ * next offset the rest of the directory can be followed from, so that one
+ * bad rec_len doesn't lose the entries behind it. That offset may be
+ * before off, as it may be the rec_len of the entry before which is bad.
+ * keep is set if the entry is still good once its rec_len is made to end
+ * there.
+ */
+static unsigned int entry_end(char *blk, struct testfs_dir_entry *prev,
+		unsigned int off, unsigned int size, int *keep)
+{
+	struct testfs_dir_entry *de = (struct testfs_dir_entry *)(blk + off);
+	unsigned int next;
+
+	*keep = 1;
+	if (sane_entry(de, off, size))
+		return off + de->rec_len;
+	next = prev ? (char *)prev - blk + calc_rec_len(prev) : off + TESTFS_NAME_ROUND + 1;
+	for (; next < size; next += TESTFS_NAME_ROUND + 1)
+		if (next != off && sane_chain(blk, next, size))
+			break;
+	if (next > size)
+		next = size;
+	*keep = next > off && de->inode && de->name_len &&
+		de->name_len <= TESTFS_MAX_NAME_LEN && off + calc_rec_len(de) <= next;
+	return next;
+}
+
+static inline int dot_or_dotdot(struct testfs_dir_entry *de)
+{
+	return de->name[0] == '.' && (de->name_len == 1 ||
+			(de->name_len == 2 && de->name[1] == '.'));
+}
+
+/*
+ * Pass 2 : directories. Walks the rec_len chain the same way the kernel
+ * does, repairs it and drops the entries pointing at inodes not in use.
+ */
+static void check_dir(unsigned int dir)
+{
+	struct testfs_inode *raw = get_inode(dir);
+	char *blk = fs.meta + (size_t)dir*fs.bs;
+	struct testfs_dir_entry *de, *prev = NULL;
+	unsigned int off, next, size = raw->size, n = 0;
+	unsigned int hdr = sizeof(*de) - TESTFS_MAX_NAME_LEN;
+	int keep;
+
+	for (off = 0; off + hdr <= size; off = next, n++) {
+		de = (struct testfs_dir_entry *)(blk + off);
+		next = entry_end(blk, prev, off, size, &keep);
+		if (!sane_entry(de, off, size)) {
+			if (problem("Directory %u : bad entry at offset %u (rec_len %u, name_len %u), %s",
+						dir, off, de->rec_len, de->name_len,
+						keep ? "fixing its rec_len" : next < size ?
+						"skipping to the next good entry" :
+						"dropping the rest of the directory")) {
+				/* Let the entry before cover the bad one */
+				if (keep)
+					de->rec_len = next - off;
+				else if (prev)
+					prev->rec_len = next - ((char *)prev - blk);
+				else {
+					de->inode = 0;
+					de->rec_len = next - off;
+				}
+			}
+			if (!keep)
+				continue;
+		}
+		prev = de;
+		if (!de->inode)
+			continue;
+		__sync_fetch_and_add(&fs.dirents, 1);
+
+		if (n == 0 && (de->name_len != 1 || de->name[0] != '.' || de->inode != dir))
+			unfixable("Directory %u : first entry is not \".\"", dir);
+		if (!valid_inode(de->inode) || fs.state[de->inode] == INODE_FREE ||
+				fs.state[de->inode] == INODE_BAD) {
+			if (problem("Directory %u : entry \"%.*s\" points at %s inode %u", dir,
+						de->name_len, de->name,
+						valid_inode(de->inode) ? "free" : "invalid", de->inode))
+				de->inode = 0;
+		}
+	}
+}
+
+static void *pass2_worker(void *arg)
+{
+	unsigned int i;
+
+	while ((i = __sync_fetch_and_add(&fs.next, 1)) < fs.nr_dirs)
+		check_dir(fs.dirs[i]);
+	return NULL;
+}
+
+/*
+ * Pass 3 : walk the tree from the root. Only the entries of directories
+ * which can be reached count, so everything below a directory which is
+ * not in the tree is unattached as well. Without -y pass 2 repaired
+ * nothing, so bad entries are skipped here the same way.
+ */
+static void count_refs(void)
+{
+	struct testfs_dir_entry *de, *prev;
+	unsigned int hdr = sizeof(*de) - TESTFS_MAX_NAME_LEN;
+	unsigned int i, n = 0, dir, off, next, size, ino;
+	unsigned char *seen;
+	char *blk;
+	int keep;
+
+	/* check_counts() complains about it */
+	if (fs.state[fs.first] != INODE_DIR)
+		return;
+	seen = calloc(fs.max, 1);
+	if (!seen) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		exit(FSCK_ERROR);
+	}
+	/* fs.dirs is free again once pass 2 is done */
+	fs.dirs[n++] = fs.first;
+	seen[fs.first] = 1;
+	for (i = 0; i < n; i++) {
+		dir = fs.dirs[i];
+		blk = fs.meta + (size_t)dir*fs.bs;
+		size = get_inode(dir)->size;
+		prev = NULL;
+		for (off = 0; off + hdr <= size; off = next) {
+			de = (struct testfs_dir_entry *)(blk + off);
+			next = entry_end(blk, prev, off, size, &keep);
+			if (!keep)
+				continue;
+			prev = de;
+			ino = de->inode;
+			if (!ino || !valid_inode(ino) || fs.state[ino] == INODE_FREE ||
+					fs.state[ino] == INODE_BAD)
+				continue;
+			fs.refs[ino]++;
+			if (dot_or_dotdot(de))
+				continue;
+			fs.named[ino]++;
+			if (fs.state[ino] == INODE_DIR && !seen[ino]) {
+				seen[ino] = 1;
+				fs.dirs[n++] = ino;
+			}
+		}
+	}
+	free(seen);
+}
+
+/*
+ * Inodes on the orphan list aren't in any directory, the kernel frees
+ * them at the next mount
+ */
+static void read_orphans(void)
+{
+	unsigned int ino = fs.sb->s_last_orphan;
+	unsigned int n;
+
+	for (n = 0; ino && n < fs.max; n++) {
+		if (!valid_inode(ino) || fs.orphan[ino]) {
+			unfixable("Orphan list is corrupt at inode %u", ino);
+			return;
+		}
+		fs.orphan[ino] = 1;
+		ino = get_inode(ino)->next_orphan;
+	}
+}
+
+/*
+ * Pass 4 : link counts, unattached inodes and the free count
+ */
+static void check_counts(void)
+{
+	unsigned int ino, used = 0, expect;
+	struct testfs_inode *raw;
+
+	if (fs.state[fs.first] != INODE_DIR) {
+		unfixable("Root inode %u is not an allocated directory", fs.first);
+		return;
+	}
+	for (ino = 0; ino < fs.first; ino++) {
+		if (!test_bit(fs.bitmap, ino)) {
+			if (problem("Reserved block %u is marked free", ino))
+				fs.bitmap[ino/8] |= 1 << (ino%8);
+		}
+	}
+	read_orphans();
+	for (ino = fs.first; ino < fs.max; ino++) {
+		if (fs.state[ino] == INODE_FREE)
+			continue;
+		raw = get_inode(ino);
+		if (fs.state[ino] == INODE_BAD) {
+			if (problem("Inode %u has unknown type 0%o, freeing it", ino, raw->type)) {
+				clear_bit(fs.bitmap, ino);
+				raw->nlinks = 0;
+				continue;
+			}
+		} else if (ino != fs.first && !fs.named[ino] && !fs.orphan[ino]) {
+			if (problem("Inode %u is not in any directory, freeing it", ino)) {
+				clear_bit(fs.bitmap, ino);
+				raw->nlinks = 0;
+				continue;
+			}
+		} else if (fs.refs[ino] && raw->nlinks != fs.refs[ino]) {
+			if (problem("Inode %u has link count %u, should be %u", ino,
+						raw->nlinks, fs.refs[ino]))
+				raw->nlinks = fs.refs[ino];
+		}
+		used++;
+	}
+	expect = fs.max - used;
+	if (fs.sb->s_free_inodes != expect &&
+			problem("Free inode count is %u, should be %u", fs.sb->s_free_inodes, expect))
+		fs.sb->s_free_inodes = expect;
+}
+
+static void run_pass(void *(*worker)(void *), int nthreads)
+{
+	pthread_t threads[MAX_THREADS];
+	int i;
+
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, worker, NULL)) {
+			fprintf(stderr, "Unable to create threads\n");
+			exit(FSCK_ERROR);
+		}
+	}
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+}
+
+int main(int argc, char **argv)
+{
+	char *metadev = NULL;
+	int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	int timing = 0;
+	size_t size;
+	char *map;
+	double t, t1, t2, t3;
+	unsigned int ino;
+	int c;
+
+	progname = argv[0];
+	while ((c = getopt(argc, argv, "nyj:tm:h")) != -1) {
+		switch (c) {
+		case 'n':
+			fs.fix = 0;
+			break;
+		case 'y':
+			fs.fix = 1;
+			break;
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		case 't':
+			timing = 1;
+			break;
+		case 'm':
+			metadev = optarg;
+			break;
+		default:
+			usage();
+			exit(FSCK_ERROR);
+		}
+	}
+	if (optind >= argc) {
+		usage();
+		exit(FSCK_ERROR);
+	}
+	if (nthreads < 1)
+		nthreads = 1;
+	if (nthreads > MAX_THREADS)
+		nthreads = MAX_THREADS;
+	pthread_mutex_init(&fs.lock, NULL);
+
+	map = map_device(argv[optind], &size);
+	fs.sb = find_superblock(map, size);
+	if (!fs.sb) {
+		fprintf(stderr, "Can't find a testfs superblock on %s\n", argv[optind]);
+		exit(FSCK_ERROR);
+	}
+	fs.meta = map;
+	fs.meta_size = size;
+	check_superblock(argv[optind], metadev);
+
+	fs.state = calloc(fs.max, 1);
+	fs.orphan = calloc(fs.max, 1);
+	fs.refs = calloc(fs.max, sizeof(*fs.refs));
+	fs.named = calloc(fs.max, sizeof(*fs.named));
+	fs.dirs = calloc(fs.max, sizeof(*fs.dirs));
+	if (!fs.state || !fs.orphan || !fs.refs || !fs.named || !fs.dirs) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		exit(FSCK_ERROR);
+	}
+
+	t = now();
+	fs.next = fs.first;
+	run_pass(pass1_worker, nthreads);
+	t1 = now() - t;
+
+	for (ino = fs.first; ino < fs.max; ino++)
+		if (fs.state[ino] == INODE_DIR)
+			fs.dirs[fs.nr_dirs++] = ino;
+	t = now();
+	fs.next = 0;
+	run_pass(pass2_worker, nthreads);
+	t2 = now() - t;
+
+	t = now();
+	count_refs();
+	check_counts();
+	t3 = now() - t;
+
+	if (fs.fix && msync(fs.meta, fs.meta_size, MS_SYNC) == -1) {
+		perror("Unable to write the repairs ");
+		exit(FSCK_ERROR);
+	}
+	if (fs.fix && fs.meta != map && msync(map, size, MS_SYNC) == -1) {
+		perror("Unable to write the repairs ");
+		exit(FSCK_ERROR);
+	}
+
+	if (timing) {
+		printf("Pass 1 : %u inodes in %.3f ms (%.0f inodes/s)\n", fs.max - fs.first,
+				t1*1e3, (fs.max - fs.first)/t1);
+		printf("Pass 2 : %u directories, %lu entries in %.3f ms (%.0f entries/s, %.1f MB/s)\n",
+				fs.nr_dirs, fs.dirents, t2*1e3, fs.dirents/t2,
+				(double)fs.nr_dirs*fs.bs/t2/1e6);
+		printf("Pass 3 and 4 : %.3f ms\n", t3*1e3);
+	}
+	printf("%s : %u/%u inodes free, %lu problems found, %lu fixed\n", argv[optind],
+			fs.sb->s_free_inodes, fs.max, fs.errors + fs.fixed, fs.fixed);
+	if (fs.errors)
+		return FSCK_UNCORRECTED;
+	return fs.fixed ? FSCK_FIXED : FSCK_OK;
+}
@@ -0,0 +1,153 @@
+/***********************************************************/
+/*  Author : Manish Katiyar <mkatiyar@gmail.com>           */
+/*  Description : A simple disk based filesystem for linux */
+/*  Date   : 08/01/09                                      */
+/*  Version : 0.01                                         */
+/*  Distributed under GPL                                  */
+/***********************************************************/
+
+/*
+ * Block layer of libtestfs. Blocks are read and written with pread/pwrite,
+ * metadata blocks (bitmap, inode table, directories) go to the metadata
+ * device if the filesystem has one.
+ */
+#include<stdio.h>
+#include<stdlib.h>
+#include<fcntl.h>
+#include<string.h>
+#include<unistd.h>
+#include<errno.h>
+#include "libtestfs.h"
+
+static int image_fd(struct testfs_image *img, int meta)
+{
+	return meta ? img->metafd : img->fd;
+}
+
+/*
+ * The superblock is in block 1, so look for it at every blocksize
+ * like the kernel does
+ */
+static int find_superblock(int fd, struct testfs_super_block *sb)
+{
+	unsigned int bs;
+
+	for (bs = TESTFS_MIN_BLOCKSIZE; bs <= TESTFS_MAX_BLOCKSIZE; bs <<= 1) {
+		if (pread(fd, sb, sizeof(*sb), TESTFS_SUPERBLOCK*(off_t)bs) != sizeof(*sb))
+			break;
+		if (sb->s_magic == TESTFS_MAGIC && sb->s_blocksize == bs)
+			return 0;
+	}
+	return -EINVAL;
+}
+
+/*
+ * Open the filesystem on device, flags are O_RDONLY or O_RDWR. metadev
+ * is needed for filesystems made with "mktestfs -m".
+ */
+int testfs_image_open(struct testfs_image *img, const char *device,
+		const char *metadev, int flags)
+{
+	struct testfs_super_block msb;
+	int err;
+
+	memset(img, 0, sizeof(*img));
+	img->fd = open(device, flags);
+	if (img->fd == -1)
+		return -errno;
+	img->metafd = img->fd;
+	err = find_superblock(img->fd, &img->sb);
+	if (err)
+		goto out;
+	img->blocksize = img->sb.s_blocksize;
+
+	err = -EINVAL;
+	if (!(img->sb.s_features & TESTFS_FEATURE_METADEV))
+		return 0;
+	if (!metadev)
+		goto out;
+	img->metafd = open(metadev, flags);
+	if (img->metafd == -1) {
+		err = -errno;
+		img->metafd = img->fd;
+		goto out;
+	}
+	if (find_superblock(img->metafd, &msb) || msb.s_meta_id != img->sb.s_meta_id)
+		goto out;
+	return 0;
+out:
+	testfs_image_close(img);
+	return err;
+}
+
+void testfs_image_close(struct testfs_image *img)
+{
+	if (img->metafd != img->fd)
+		close(img->metafd);
+	close(img->fd);
+	img->fd = img->metafd = -1;
+}
+
+int testfs_image_read(struct testfs_image *img, int meta, unsigned int block, void *buf)
+{
+	ssize_t ret = pread(image_fd(img, meta), buf, img->blocksize,
+			(off_t)block*img->blocksize);
+	if (ret == -1)
+		return -errno;
+	return ret == img->blocksize ? 0 : -EIO;
+}
+
+int testfs_image_write(struct testfs_image *img, int meta, unsigned int block,
+		const void *buf)
+{
+	ssize_t ret = pwrite(image_fd(img, meta), buf, img->blocksize,
+			(off_t)block*img->blocksize);
+	if (ret == -1)
+		return -errno;
+	return ret == img->blocksize ? 0 : -EIO;
+}
+
+int testfs_image_read_inode(struct testfs_image *img, unsigned int ino,
+		struct testfs_inode *raw)
+{
+	unsigned int block, offset;
+	ssize_t ret;
+	int err = testfs_inode_location(&img->sb, ino, &block, &offset);
+
+	if (err)
+		return err;
+	ret = pread(img->metafd, raw, sizeof(*raw), (off_t)block*img->blocksize + offset);
+	if (ret == -1)
+		return -errno;
+	return ret == sizeof(*raw) ? 0 : -EIO;
+}
+
+int testfs_image_write_inode(struct testfs_image *img, unsigned int ino,
+		const struct testfs_inode *raw)
+{
+	unsigned int block, offset;
+	ssize_t ret;
+	int err = testfs_inode_location(&img->sb, ino, &block, &offset);
+
+	if (err)
+		return err;
+	ret = pwrite(img->metafd, raw, sizeof(*raw), (off_t)block*img->blocksize + offset);
+	if (ret == -1)
+		return -errno;
+	return ret == sizeof(*raw) ? 0 : -EIO;
+}
+
+/*
+ * Write back img->sb. Both devices carry the superblock.
+ */
+int testfs_image_write_super(struct testfs_image *img)
+{
+	off_t off = TESTFS_SUPERBLOCK*(off_t)img->blocksize;
+
+	if (pwrite(img->fd, &img->sb, sizeof(img->sb), off) != sizeof(img->sb))
+		return -EIO;
+	if (img->metafd != img->fd &&
+			pwrite(img->metafd, &img->sb, sizeof(img->sb), off) != sizeof(img->sb))
+		return -EIO;
+	return 0;
+}
@@ -0,0 +1,37 @@
+/***********************************************************/
+/*  Author : Manish Katiyar <mkatiyar@gmail.com>           */
+/*  Description : A simple disk based filesystem for linux */
+/*  Date   : 08/01/09                                      */
+/*  Version : 0.01                                         */
+/*  Distributed under GPL                                  */
+/***********************************************************/
+#ifndef __LIBTESTFS__
+#define __LIBTESTFS__
+
+/*
+ * libtestfs.a : the on disk format code of the kernel module (format.c)
+ * plus a block layer on top of an image file or device, for the tools.
+ * Functions return 0 or a negative errno like the kernel does.
+ */
+#include "../testfs.h"
+
+struct testfs_image {
+	int fd;
+	int metafd;	/* Same as fd unless the metadata is on another device */
+	unsigned int blocksize;
+	struct testfs_super_block sb;
+};
+
+extern int testfs_image_open(struct testfs_image *img, const char *device,
+		const char *metadev, int flags);
+extern void testfs_image_close(struct testfs_image *img);
+extern int testfs_image_read(struct testfs_image *img, int meta, unsigned int block, void *buf);
+extern int testfs_image_write(struct testfs_image *img, int meta, unsigned int block,
+		const void *buf);
+extern int testfs_image_read_inode(struct testfs_image *img, unsigned int ino,
+		struct testfs_inode *raw);
+extern int testfs_image_write_inode(struct testfs_image *img, unsigned int ino,
+		const struct testfs_inode *raw);
+extern int testfs_image_write_super(struct testfs_image *img);
+
+#endif /* __LIBTESTFS__ */
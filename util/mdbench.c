@@ -0,0 +1,551 @@
+/***********************************************************/
+/*  Author : Manish Katiyar <mkatiyar@gmail.com>           */
+/*  Description : A simple disk based filesystem for linux */
+/*  Date   : 08/01/09                                      */
+/*  Version : 0.01                                         */
+/*  Distributed under GPL                                  */
+/***********************************************************/
+
+/*
+ * mdtest like benchmark of the metadata operations : create, stat, lookup
+ * of existing and missing names, readdir and unlink, for every combination
+ * of thread count and directory size given. Results go to stdout as JSON,
+ * a summary to stderr. Run it on a directory of a mounted testfs, through
+ * the module or testfs-fuse, eg.
+ *	mdbench -t 1,2,4 -n 16,64,128 -D mnt
+ * With -M it runs the same operations on the libtestfs code in memory
+ * instead (testfs_find_free_bit(), testfs_add_dirent(),
+ * testfs_search_dirents() ...), which is the code testfs_find_free_inode()
+ * and testfs_find_dentry() run in the kernel.
+ */
+#define _GNU_SOURCE
+#include<stdio.h>
+#include<stdlib.h>
+#include<fcntl.h>
+#include<string.h>
+#include<unistd.h>
+#include<errno.h>
+#include<time.h>
+#include<dirent.h>
+#include<pthread.h>
+#include<sys/stat.h>
+#include<sys/statvfs.h>
+#include "libtestfs.h"
+
+#define MDBENCH_TOOL "mdbench"
+#define MDBENCH_VERSION "1.0.0"
+#define MAX_THREADS 64
+#define MAX_RUNS 16
+
+enum {
+	PH_CREATE,
+	PH_STAT,
+	PH_LOOKUP_HIT,
+	PH_LOOKUP_MISS,
+	PH_READDIR,
+	PH_UNLINK,
+	NR_PHASES
+};
+
+static const char *phase_names[NR_PHASES] = {
+	"create", "stat", "lookup_hit", "lookup_miss", "readdir", "unlink",
+};
+
+/*
+ * A directory of a testfs kept in memory, for -M
+ */
+struct memfs {
+	struct testfs_super_block sb;
+	unsigned char *bitmap;
+	char *meta;		/* Blocks 0 upto the end of the inode table */
+	char *dir;		/* The directory block the names go into */
+};
+
+struct bench_thread {
+	pthread_t tid;
+	unsigned int id;
+	unsigned int items;	/* Names this thread creates and works on */
+	unsigned long long *lat;	/* Latency of every operation of the phase in ns */
+	unsigned long ops;
+	unsigned long long start, end;	/* When the thread started and ended the phase */
+	int err;
+	struct memfs mfs;
+};
+
+/*
+ * State of the run
+ */
+struct bench {
+	const char *dir;
+	int memory;		/* -M */
+	int drop_caches;	/* -D */
+	unsigned int blocksize;	/* Of the in memory filesystem */
+	unsigned int scans;	/* Readdirs per thread */
+	int phase;
+	unsigned int nr_threads;
+	pthread_barrier_t start, done;
+	struct bench_thread threads[MAX_THREADS];
+};
+
+static struct bench bench;
+char *progname;
+
+static void usage()
+{
+	fprintf(stderr,"%s (version %s) - Metadata operation benchmark\n",
+			MDBENCH_TOOL, MDBENCH_VERSION);
+	fprintf(stderr,"Usage : %s [-t threads,...] [-n files,...] [-r scans] [-i iterations] "
+			"[-D] [-o file] dir\n", progname);
+	fprintf(stderr,"       %s -M [-b blocksize] [-t threads,...] [-n files,...] ...\n", progname);
+	fprintf(stderr,"\t-t : Thread counts to run with (default 1,2,4)\n");
+	fprintf(stderr,"\t-n : Directory sizes, the threads share the files (default 16,64,128). A\n"
+			"\t     directory is one block, which holds 169 names at 4K blocksize\n");
+	fprintf(stderr,"\t-r : Readdirs of the whole directory per thread (default 100)\n");
+	fprintf(stderr,"\t-i : Times to repeat every run (default 1)\n");
+	fprintf(stderr,"\t-D : Drop the caches before every phase, so lookups reach testfs (needs root)\n");
+	fprintf(stderr,"\t-M : Run on the libtestfs code in memory, every thread with its own directory\n");
+	fprintf(stderr,"\t-b : Blocksize for -M (default %d)\n", TESTFS_DFLT_BLOCKSIZE);
+	fprintf(stderr,"\t-o : Write the JSON results to file instead of stdout\n");
+	return;
+}
+
+static inline unsigned long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Names stay within TESTFS_MAX_NAME_LEN. Missing names use another prefix.
+ */
+static void file_name(char *buf, size_t len, unsigned int thread, unsigned int i, int missing)
+{
+	snprintf(buf, len, "%c%02x%05u", missing ? 'n' : 'm', thread, i);
+}
+
+/*
+ * Names which fit in a directory, which is a single block of bs bytes
+ * starting with "." and "..".
+ */
+static unsigned int dir_capacity(unsigned int bs)
+{
+	char name[32];
+
+	file_name(name, sizeof(name), 0, 0, 0);
+	return (bs - calc_reclen_from_len(1) - calc_reclen_from_len(2))/
+		calc_reclen_from_len(strlen(name));
+}
+
+static int parse_list(char *arg, unsigned int *list, unsigned int max)
+{
+	unsigned int n = 0;
+	char *tok;
+
+	for (tok = strtok(arg, ","); tok && n < max; tok = strtok(NULL, ",")) {
+		list[n] = strtoul(tok, NULL, 0);
+		if (!list[n])
+			return 0;
+		n++;
+	}
+	return n;
+}
+
+static void drop_caches(void)
+{
+	int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+
+	sync();
+	if (fd == -1 || write(fd, "3", 1) != 1) {
+		fprintf(stderr, "Unable to drop caches (%s), lookups may be served by the dcache\n",
+				strerror(errno));
+		bench.drop_caches = 0;
+	}
+	if (fd != -1)
+		close(fd);
+}
+
+/*
+ * In memory filesystem with the largest inode table the bitmap can map
+ */
+static int memfs_init(struct memfs *m, unsigned int bs)
+{
+	unsigned int ipb = bs/sizeof(struct testfs_inode);
+	unsigned int itable = bs*8/ipb;
+	unsigned int i;
+
+	memset(&m->sb, 0, sizeof(m->sb));
+	m->sb.s_magic = TESTFS_MAGIC;
+	m->sb.s_blocksize = bs;
+	m->sb.s_itable_blocks = itable;
+	m->sb.s_first_nonmeta_inode = TESTFS_INODE_TABLE_BLOCK + itable;
+	m->sb.s_max_inodes = itable*ipb;
+	m->meta = calloc(TESTFS_INODE_TABLE_BLOCK + itable, bs);
+	m->dir = malloc(bs);
+	if (!m->meta || !m->dir)
+		return -ENOMEM;
+	m->bitmap = (unsigned char *)m->meta + TESTFS_INODE_BM_BLOCK*bs;
+	for (i = 0; i <= m->sb.s_first_nonmeta_inode; i++)
+		m->bitmap[i/8] |= 1 << (i%8);
+	testfs_init_dirblock(m->dir, bs, m->sb.s_first_nonmeta_inode, m->sb.s_first_nonmeta_inode);
+	return 0;
+}
+
+static void memfs_free(struct memfs *m)
+{
+	free(m->meta);
+	free(m->dir);
+}
+
+static struct testfs_inode *memfs_inode(struct memfs *m, unsigned int ino)
+{
+	unsigned int block, offset;
+
+	if (testfs_inode_location(&m->sb, ino, &block, &offset))
+		return NULL;
+	return (struct testfs_inode *)(m->meta + (size_t)block*m->sb.s_blocksize + offset);
+}
+
+/*
+ * One operation of the phase on the in memory filesystem
+ */
+static int memfs_op(struct memfs *m, int phase, const char *name)
+{
+	unsigned int len = strlen(name), scanned = 0, ino;
+	unsigned int bs = m->sb.s_blocksize;
+	struct testfs_dir_entry *de;
+	struct testfs_inode *raw;
+	struct stat st;
+	char *pos;
+	int err;
+
+	switch (phase) {
+	case PH_CREATE:
+		ino = testfs_find_free_bit(m->bitmap, NULL, m->sb.s_first_nonmeta_inode,
+				m->sb.s_max_inodes, &scanned);
+		if (!ino)
+			return -ENOSPC;
+		err = testfs_add_dirent(m->dir, bs, name, len, ino, S_IFREG);
+		if (err)
+			return err;
+		m->bitmap[ino/8] |= 1 << (ino%8);
+		raw = memfs_inode(m, ino);
+		memset(raw, 0, sizeof(*raw));
+		raw->type = S_IFREG | 0644;
+		raw->nlinks = 1;
+		raw->data[0] = ino;
+		return 0;
+	case PH_STAT:
+		err = testfs_search_dirents(m->dir, m->dir + bs, name, len, &de, &scanned);
+		if (err)
+			return err;
+		raw = memfs_inode(m, de->inode);
+		st.st_mode = raw->type;
+		st.st_size = raw->size;
+		return st.st_mode ? 0 : -EIO;
+	case PH_LOOKUP_HIT:
+		return testfs_search_dirents(m->dir, m->dir + bs, name, len, &de, &scanned);
+	case PH_LOOKUP_MISS:
+		err = testfs_search_dirents(m->dir, m->dir + bs, name, len, &de, &scanned);
+		return err == -ENOENT ? 0 : -EEXIST;
+	case PH_READDIR:
+		for (pos = m->dir, err = 0; pos < m->dir + bs;
+				pos += ((struct testfs_dir_entry *)pos)->rec_len)
+			err += ((struct testfs_dir_entry *)pos)->inode != 0;
+		return err ? 0 : -EIO;
+	case PH_UNLINK:
+		ino = testfs_remove_dirent(m->dir, bs, name, len);
+		if (!ino)
+			return -ENOENT;
+		m->bitmap[ino/8] &= ~(1 << (ino%8));
+		return 0;
+	}
+	return -EINVAL;
+}
+
+/*
+ * One operation of the phase on the mounted filesystem
+ */
+static int fs_op(int phase, const char *path)
+{
+	struct stat st;
+	struct dirent *d;
+	DIR *dir;
+	int fd;
+
+	switch (phase) {
+	case PH_CREATE:
+		fd = open(path, O_CREAT|O_EXCL|O_WRONLY, 0644);
+		if (fd == -1)
+			return -errno;
+		close(fd);
+		return 0;
+	case PH_STAT:
+		return stat(path, &st) ? -errno : 0;
+	case PH_LOOKUP_HIT:
+		return access(path, F_OK) ? -errno : 0;
+	case PH_LOOKUP_MISS:
+		return access(path, F_OK) && errno == ENOENT ? 0 : -EEXIST;
+	case PH_READDIR:
+		dir = opendir(path);
+		if (!dir)
+			return -errno;
+		while ((d = readdir(dir)) != NULL)
+			;
+		closedir(dir);
+		return 0;
+	case PH_UNLINK:
+		return unlink(path) ? -errno : 0;
+	}
+	return -EINVAL;
+}
+
+static void *bench_worker(void *arg)
+{
+	struct bench_thread *t = arg;
+	char name[32], path[PATH_MAX];
+	unsigned long long start;
+	unsigned int i, n;
+	int err;
+
+	for (;;) {
+		pthread_barrier_wait(&bench.start);
+		if (bench.phase < 0)
+			break;
+		n = bench.phase == PH_READDIR ? bench.scans : t->items;
+		t->ops = 0;
+		t->start = now_ns();
+		for (i = 0; i < n && !t->err; i++) {
+			file_name(name, sizeof(name), t->id, i, bench.phase == PH_LOOKUP_MISS);
+			start = now_ns();
+			if (bench.memory) {
+				err = memfs_op(&t->mfs, bench.phase, name);
+			} else {
+				if (bench.phase == PH_READDIR)
+					snprintf(path, sizeof(path), "%s", bench.dir);
+				else
+					snprintf(path, sizeof(path), "%s/%s", bench.dir, name);
+				err = fs_op(bench.phase, path);
+			}
+			t->lat[i] = now_ns() - start;
+			if (err) {
+				t->err = err;
+				fprintf(stderr, "%s of %s failed : %s\n", phase_names[bench.phase],
+						name, strerror(-err));
+				break;
+			}
+			t->ops++;
+		}
+		t->end = now_ns();
+		pthread_barrier_wait(&bench.done);
+	}
+	return NULL;
+}
+
+static int cmp_ull(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Latency percentiles of the phase over all threads, in ns
+ */
+static void percentiles(unsigned long long *all, unsigned long n, unsigned long long *p50,
+		unsigned long long *p99, unsigned long long *max)
+{
+	qsort(all, n, sizeof(*all), cmp_ull);
+	*p50 = n ? all[n/2] : 0;
+	*p99 = n ? all[(n*99)/100] : 0;
+	*max = n ? all[n - 1] : 0;
+}
+
+/*
+ * Run all the phases with threads threads on a directory of files names.
+ * Returns 0 if all operations succeeded.
+ */
+static int run(FILE *out, int *first, unsigned int threads, unsigned int files,
+		unsigned int iteration)
+{
+	unsigned int i, per_thread = (files + threads - 1)/threads;
+	unsigned long long t0, t1, p50, p99, max, *all;
+	unsigned long ops, entries;
+	int phase, err = 0;
+	double secs;
+
+	if (bench.memory)
+		per_thread = files;
+	bench.nr_threads = threads;
+	pthread_barrier_init(&bench.start, NULL, threads + 1);
+	pthread_barrier_init(&bench.done, NULL, threads + 1);
+	all = malloc(sizeof(*all)*(unsigned long)threads*(per_thread > bench.scans ? per_thread : bench.scans));
+	for (i = 0; i < threads; i++) {
+		struct bench_thread *t = &bench.threads[i];
+		t->id = i;
+		t->items = per_thread;
+		t->err = 0;
+		t->lat = malloc(sizeof(*t->lat)*(per_thread > bench.scans ? per_thread : bench.scans));
+		if (!all || !t->lat || (bench.memory && memfs_init(&t->mfs, bench.blocksize))) {
+			fprintf(stderr, "Unable to allocate memory\n");
+			exit(-1);
+		}
+		pthread_create(&t->tid, NULL, bench_worker, t);
+	}
+
+	for (phase = 0; phase < NR_PHASES; phase++) {
+		if (bench.drop_caches && !bench.memory)
+			drop_caches();
+		bench.phase = phase;
+		pthread_barrier_wait(&bench.start);
+		pthread_barrier_wait(&bench.done);
+
+		/* From the first thread starting till the last one is done */
+		t0 = ~0ULL;
+		t1 = 0;
+		for (i = 0, ops = 0; i < threads; i++) {
+			if (bench.threads[i].start < t0)
+				t0 = bench.threads[i].start;
+			if (bench.threads[i].end > t1)
+				t1 = bench.threads[i].end;
+			memcpy(all + ops, bench.threads[i].lat, sizeof(*all)*bench.threads[i].ops);
+			ops += bench.threads[i].ops;
+			if (bench.threads[i].err)
+				err = bench.threads[i].err;
+		}
+		percentiles(all, ops, &p50, &p99, &max);
+		secs = (t1 - t0)/1e9;
+		/* A readdir returns the whole directory and "." and ".." */
+		entries = phase == PH_READDIR ? ops*(per_thread*(bench.memory ? 1 : threads) + 2) : ops;
+		fprintf(out, "%s\n    {\"iteration\": %u, \"threads\": %u, \"files\": %u, "
+				"\"phase\": \"%s\", \"ops\": %lu, \"seconds\": %.6f, "
+				"\"ops_per_sec\": %.1f, \"entries_per_sec\": %.1f, "
+				"\"lat_ns\": {\"p50\": %llu, \"p99\": %llu, \"max\": %llu}, "
+				"\"errors\": %d}",
+				*first ? "" : ",", iteration, threads, files, phase_names[phase],
+				ops, secs, ops/secs, entries/secs, p50, p99, max, err != 0);
+		*first = 0;
+		fprintf(stderr, "%3u threads %6u files %-12s %10.0f ops/s  p50 %8.1f us  p99 %8.1f us\n",
+				threads, files, phase_names[phase], ops/secs, p50/1e3, p99/1e3);
+		if (err)
+			break;
+	}
+
+	/* Tell the workers to go away */
+	bench.phase = -1;
+	pthread_barrier_wait(&bench.start);
+	for (i = 0; i < threads; i++) {
+		pthread_join(bench.threads[i].tid, NULL);
+		free(bench.threads[i].lat);
+		if (bench.memory)
+			memfs_free(&bench.threads[i].mfs);
+	}
+	pthread_barrier_destroy(&bench.start);
+	pthread_barrier_destroy(&bench.done);
+	free(all);
+	return err;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int threads[MAX_RUNS] = { 1, 2, 4 }, nr_threads = 3;
+	unsigned int files[MAX_RUNS] = { 16, 64, 128 }, nr_files = 3;
+	unsigned int iterations = 1, i, j, k, names, max;
+	struct statvfs sv;
+	FILE *out = stdout;
+	int c, first = 1, err = 0;
+
+	progname = argv[0];
+	bench.blocksize = TESTFS_DFLT_BLOCKSIZE;
+	bench.scans = 100;
+	while ((c = getopt(argc, argv, "t:n:r:i:b:o:DMh")) != -1) {
+		switch (c) {
+		case 't':
+			nr_threads = parse_list(optarg, threads, MAX_RUNS);
+			break;
+		case 'n':
+			nr_files = parse_list(optarg, files, MAX_RUNS);
+			break;
+		case 'r':
+			bench.scans = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			bench.blocksize = strtoul(optarg, NULL, 0);
+			if (bench.blocksize < TESTFS_MIN_BLOCKSIZE || bench.blocksize > TESTFS_MAX_BLOCKSIZE ||
+					(bench.blocksize & (bench.blocksize - 1))) {
+				fprintf(stderr, "Invalid blocksize %s\n", optarg);
+				exit(-1);
+			}
+			break;
+		case 'o':
+			out = fopen(optarg, "w");
+			if (!out) {
+				perror(optarg);
+				exit(-1);
+			}
+			break;
+		case 'D':
+			bench.drop_caches = 1;
+			break;
+		case 'M':
+			bench.memory = 1;
+			break;
+		default:
+			usage();
+			exit(-1);
+		}
+	}
+	for (i = 0; i < nr_threads; i++)
+		if (threads[i] > MAX_THREADS)
+			nr_threads = 0;
+	for (i = 0; i < nr_files; i++)
+		if (files[i] > 99999)
+			nr_files = 0;
+	if (!nr_threads || !nr_files || !bench.scans || !iterations ||
+			(!bench.memory && optind >= argc)) {
+		usage();
+		exit(-1);
+	}
+	if (!bench.memory) {
+		bench.dir = argv[optind];
+		if (statvfs(bench.dir, &sv) == -1) {
+			perror(bench.dir);
+			exit(-1);
+		}
+	}
+	/* Don't find out half way through that the directory is full */
+	max = dir_capacity(bench.memory ? bench.blocksize : sv.f_bsize);
+	for (i = 0; i < nr_threads; i++)
+		for (j = 0; j < nr_files; j++) {
+			/* Threads share the directory, each creating as many names */
+			names = files[j];
+			if (!bench.memory)
+				names = (files[j] + threads[i] - 1)/threads[i]*threads[i];
+			if (names > max) {
+				fprintf(stderr, "A directory of %u names doesn't fit in one %u byte "
+						"block, it holds at most %u\n", names,
+						bench.memory ? bench.blocksize : (unsigned int)sv.f_bsize, max);
+				exit(-1);
+			}
+		}
+
+	fprintf(out, "{\n  \"tool\": \"%s\", \"version\": \"%s\",\n", MDBENCH_TOOL, MDBENCH_VERSION);
+	if (bench.memory)
+		fprintf(out, "  \"target\": \"memory\", \"blocksize\": %u,\n", bench.blocksize);
+	else
+		fprintf(out, "  \"target\": \"%s\", \"blocksize\": %lu, \"files_total\": %lu, "
+				"\"files_free\": %lu,\n", bench.dir, sv.f_bsize,
+				(unsigned long)sv.f_files, (unsigned long)sv.f_ffree);
+	fprintf(out, "  \"results\": [");
+	for (k = 0; k < iterations && !err; k++)
+		for (i = 0; i < nr_threads && !err; i++)
+			for (j = 0; j < nr_files && !err; j++)
+				err = run(out, &first, threads[i], files[j], k);
+	fprintf(out, "\n  ]\n}\n");
+	if (out != stdout)
+		fclose(out);
+	return err ? 1 : 0;
+}
@@ -6,6 +6,7 @@
 /*  Distributed under GPL                                  */
 /***********************************************************/
 
+#define _GNU_SOURCE
 #include<stdio.h>
 #include<stdlib.h>
 #include<fcntl.h>
@@ -14,13 +15,18 @@
 #include<unistd.h>
 #include<time.h>
 #include<sys/types.h>
+#include<dirent.h>
+#include<errno.h>
+#include<limits.h>
+#include<sys/ioctl.h>
+#include<linux/fs.h>
+#include<linux/falloc.h>
+#include<pthread.h>
 #include "../testfs.h"
 
 #define TESTFS_VERSION "1.0.0"
 #define TESTFS_TOOL "mktestfs"
 #define TESTFS_MIN_BLOCKS 25
-#define TESTFS_DFLT_BLOCKSIZE 4096
-#define TESTFS_FIRST_NONMETA_INODE 6
 
 #define MIN(a, b) ((a) < (b) ? (a):(b))
 char *progname;
@@ -32,6 +38,21 @@ static void usage()
 {
 	fprintf(stderr,"%s (version %s) - Create a testfs filesystem\n",
 			TESTFS_TOOL, TESTFS_VERSION);
+	fprintf(stderr,"Usage : %s [-b blocksize] [-i bytes-per-inode] [-N inodes] [-L label] "
+			"[-m metadev] [-p srcdir | -d srcdir] [-j threads] [-D] [-z] device\n", progname);
+	fprintf(stderr,"\t-b blocksize : Power of 2 from %d to %d (default %d)\n",
+			TESTFS_MIN_BLOCKSIZE, TESTFS_MAX_BLOCKSIZE, TESTFS_DFLT_BLOCKSIZE);
+	fprintf(stderr,"\t-i bytes-per-inode : Size the inode table for one inode per so many bytes\n");
+	fprintf(stderr,"\t-N inodes : Size the inode table for this many inodes, more than the\n"
+			"\t   device has blocks leaves room to grow it with testfs-resize\n");
+	fprintf(stderr,"\t   (default %d inode table blocks)\n", TESTFS_INODE_TABLE_BLOCKS);
+	fprintf(stderr,"\t-L label : Volume label of upto %d characters\n", TESTFS_LABEL_LEN);
+	fprintf(stderr,"\t-m metadev : Keep bitmap, inode table and directories on metadev\n");
+	fprintf(stderr,"\t-p srcdir : Build a packed read-only image of srcdir\n");
+	fprintf(stderr,"\t-d srcdir : Copy srcdir into the new filesystem\n");
+	fprintf(stderr,"\t-j threads : Threads copying files for -p and -d (default one per cpu)\n");
+	fprintf(stderr,"\t-D : Discard the whole device before formatting it\n");
+	fprintf(stderr,"\t-z : Zero the whole inode table instead of only the used blocks\n");
 	return;
 }
 
@@ -43,125 +64,597 @@ static inline get_block_from_inode(int ino)
 	return ino;
 }
 
+/*
+ * Blocks 0 upto the end of the inode table are built in memory and
+ * written with one large write per device once everything else is on
+ * disk, so a crash while formatting never leaves a valid superblock
+ * behind pointing at half written metadata.
+ */
+struct meta_image {
+	struct testfs_super_block *sb;
+	char *buf;
+	char *bitmap;
+	char *itable;
+	unsigned int itable_used;	/* Inode table blocks with allocated inodes */
+};
+
+static void write_at(int fd, const void *buf, size_t len, off_t off, const char *what)
+{
+	if (pwrite(fd, buf, len, off) != (ssize_t)len) {
+		perror(what);
+		exit(-1);
+	}
+}
+
+static void init_meta_image(struct meta_image *mi, struct testfs_super_block *sb)
+{
+	size_t len = (size_t)(TESTFS_INODE_TABLE_BLOCK + sb->s_itable_blocks)*sb->s_blocksize;
+
+	if (posix_memalign((void **)&mi->buf, sb->s_blocksize, len)) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		exit(-1);
+	}
+	memset(mi->buf, 0, len);
+	mi->sb = sb;
+	mi->bitmap = mi->buf + TESTFS_INODE_BM_BLOCK*sb->s_blocksize;
+	mi->itable = mi->buf + TESTFS_INODE_TABLE_BLOCK*sb->s_blocksize;
+	mi->itable_used = 0;
+}
+
+static struct testfs_inode *meta_inode(struct meta_image *mi, unsigned int ino)
+{
+	unsigned int block, offset;
+
+	if (testfs_inode_location(mi->sb, ino, &block, &offset)) {
+		fprintf(stderr, "Inode %u is outside the inode table\n", ino);
+		exit(-1);
+	}
+	if (block - TESTFS_INODE_TABLE_BLOCK >= mi->itable_used)
+		mi->itable_used = block - TESTFS_INODE_TABLE_BLOCK + 1;
+	return (struct testfs_inode *)(mi->buf + (size_t)block*mi->sb->s_blocksize + offset);
+}
+
+/*
+ * Write out the metadata. Unless zero_itable is set only the inode table
+ * blocks which have inodes in them are written. The kernel fills every
+ * other slot when it allocates the inode, so nothing reads what was on
+ * the device there before and a large table costs nothing to create.
+ */
+static void write_meta_image(struct meta_image *mi, int fd, int metafd, int zero_itable)
+{
+	struct testfs_super_block *sb = mi->sb;
+	unsigned int blocks = TESTFS_INODE_TABLE_BLOCK +
+		(zero_itable ? sb->s_itable_blocks : mi->itable_used);
+
+	memcpy(mi->buf + TESTFS_SUPERBLOCK*sb->s_blocksize, sb, sizeof(*sb));
+	write_at(metafd, mi->buf, (size_t)blocks*sb->s_blocksize, 0,
+			"Unable to write metadata on device ");
+	/* The data device only carries a copy of the superblock */
+	if (metafd != fd)
+		write_at(fd, mi->buf, (size_t)TESTFS_INODE_BM_BLOCK*sb->s_blocksize, 0,
+				"Unable to write superblock ");
+	free(mi->buf);
+}
+
 /*
  * Create the root directory entries on the device
  */
-static void create_root_dir(struct testfs_super_block sb, int fd)
+static void create_root_dir(struct meta_image *mi, int fd)
 {
-	int block;
-	off_t off;
-	char buf[sb.s_blocksize];
-	struct testfs_dir_entry dirent;
-	struct testfs_inode inode;
+	struct testfs_super_block *sb = mi->sb;
+	char buf[sb->s_blocksize];
+	struct testfs_inode *inode;
+	unsigned int root = TESTFS_ROOT_INODE(sb);
 	time_t tm;
-	memset(&dirent, 0, sizeof(dirent));
-	memset(&inode, 0, sizeof(inode));
-	memset(buf, 0, sb.s_blocksize);
 
 	/*
-	 * Create entry for "."
+	 * Create entries for "." and "..", both are the root itself
 	 */
-	dirent.inode = TESTFS_ROOT_INODE(&sb);
-	dirent.name_len = 1;
-	dirent.file_type = S_IFDIR;
-	strncpy(dirent.name, ".", 1);
-	dirent.rec_len = calc_rec_len(&dirent);
-	block = get_block_from_inode(dirent.inode);
+	testfs_init_dirblock(buf, sb->s_blocksize, root, root);
+	write_at(fd, buf, sb->s_blocksize, (off_t)get_block_from_inode(root)*sb->s_blocksize,
+			"Unable to write root dirent on device ");
+	testfs_debug("Root inode = %u\n", root);
+
 	/*
-	 * Clear the block. Doesn't matter even if it fails
+	 * Create the inode for root inode
 	 */
-	off = lseek(fd, block*sb.s_blocksize, SEEK_SET);
-	write(fd, buf, sb.s_blocksize); 
-	off = lseek(fd, block*sb.s_blocksize, SEEK_SET);
-	if (off==-1) {
-		perror("Unable to create root dirs on device ");
+	inode = meta_inode(mi, root);
+	inode->uid = inode->gid = 0;
+	inode->size = sb->s_blocksize;
+	inode->type = S_IFDIR|0755;
+	inode->nlinks = 2;
+	inode->data[0] = root;
+	time(&tm);
+	inode->atime.tv_sec = inode->mtime.tv_sec = inode->ctime.tv_sec = tm;
+	return;
+}
+
+/*
+ * Update the inode and block bitmaps required for initial FS creation.
+ * Since inode and block have 1:1 correspondence they reside in the same block#2
+ */
+static void update_bitmaps(struct meta_image *mi)
+{
+	unsigned int i;
+
+	/* Mark blocks upto the root in use. Block 0 will never be used */
+	for (i = 0; i <= mi->sb->s_first_nonmeta_inode; i++)
+		mi->bitmap[i/8] |= 1 << (i%8);
+}
+
+/*
+ * Files and directories are copied into the image by writer threads in
+ * chunks of this many bytes of consecutive blocks
+ */
+#define PACK_CHUNK_BYTES (4 << 20)
+
+/*
+ * What goes into the block of an inode
+ */
+struct pack_job {
+	char *path;		/* Source of a file or symlink */
+	char *dirblock;		/* Block of a directory, built by pack_dir() */
+	unsigned int size;
+	int symlink;
+};
+
+/*
+ * State of "mktestfs -p/-d" while it copies a source tree into the image
+ */
+struct packer {
+	struct testfs_super_block *sb;
+	int fd;		/* Data blocks of files */
+	int metafd;	/* Directory blocks */
+	struct meta_image *mi;	/* Bitmap and inode table */
+	int packed;	/* Fixed size sorted dirents of a packed image */
+	unsigned int next_ino;
+	struct pack_job *jobs;	/* Indexed by inode number */
+	unsigned int chunk_blocks;
+	unsigned int nr_chunks;
+	unsigned int next_chunk;	/* Next chunk for a writer thread */
+};
+
+/*
+ * A directory entry of the source tree
+ */
+struct pack_entry {
+	char name[TESTFS_MAX_NAME_LEN + 1];
+	unsigned int len;
+	unsigned int ino;
+	struct stat st;
+};
+
+static void pack_inode(struct packer *p, unsigned int ino, struct stat *st,
+		unsigned int size, unsigned int nlinks)
+{
+	struct testfs_inode *raw = meta_inode(p->mi, ino);
+
+	raw->uid = st->st_uid;
+	raw->gid = st->st_gid;
+	raw->size = size;
+	raw->type = st->st_mode;
+	raw->nlinks = nlinks;
+	raw->data[0] = get_block_from_inode(ino);
+	raw->atime.tv_sec = st->st_atim.tv_sec;
+	raw->atime.tv_nsec = st->st_atim.tv_nsec;
+	raw->mtime.tv_sec = st->st_mtim.tv_sec;
+	raw->mtime.tv_nsec = st->st_mtim.tv_nsec;
+	raw->ctime.tv_sec = st->st_ctim.tv_sec;
+	raw->ctime.tv_nsec = st->st_ctim.tv_nsec;
+	p->mi->bitmap[ino/8] |= 1 << (ino%8);
+	p->jobs[ino].size = size;
+}
+
+static void fill_dirent(struct testfs_dir_entry *de, const char *name, unsigned int len,
+		unsigned int ino, struct stat *st)
+{
+	de->inode = ino;
+	de->name_len = len;
+	de->file_type = S_ISDIR(st->st_mode) ? S_IFDIR : S_ISREG(st->st_mode) ? S_IFREG : 0;
+	de->rec_len = sizeof(*de);
+	memcpy(de->name, name, len);
+}
+
+static int pack_entry_cmp(const void *a, const void *b)
+{
+	const struct pack_entry *x = a, *y = b;
+	return testfs_namecmp(x->name, x->len, y->name, y->len);
+}
+
+/*
+ * Queue a regular file or a symlink to be copied into its block
+ */
+static void pack_file(struct packer *p, const char *path, struct stat *st, unsigned int ino)
+{
+	unsigned int bs = p->sb->s_blocksize;
+	unsigned int size;
+
+	if (S_ISLNK(st->st_mode)) {
+		/* The kernel keeps the terminating NUL as part of the link */
+		if (st->st_size >= bs) {
+			fprintf(stderr, "%s : link target longer than a block\n", path);
+			exit(-1);
+		}
+		size = st->st_size + 1;
+		p->jobs[ino].symlink = 1;
+	} else if (S_ISREG(st->st_mode)) {
+		if (st->st_size > bs) {
+			fprintf(stderr, "%s : files can't be larger than a block (%u bytes)\n", path, bs);
+			exit(-1);
+		}
+		size = st->st_size;
+	} else {
+		fprintf(stderr, "%s : only directories, files and symlinks can be copied\n", path);
 		exit(-1);
 	}
-	if (write(fd, (char *)&dirent, dirent.rec_len) == -1) {
-		perror("Unable to write root dirent on device ");
+	p->jobs[ino].path = strdup(path);
+	if (!p->jobs[ino].path) {
+		fprintf(stderr, "Unable to allocate memory\n");
 		exit(-1);
 	}
+	pack_inode(p, ino, st, size, 1);
+}
 
-	/*
-	 * Create entry for ".."
-	 */
-	memset(&dirent, 0, sizeof(dirent));
-	dirent.inode = TESTFS_ROOT_INODE(&sb);
-	dirent.name_len = 2;
-	dirent.file_type = S_IFDIR;
-	strncpy(dirent.name, "..", 2);
-	dirent.rec_len = sb.s_blocksize - calc_reclen_from_len(1);
-	if (write(fd, (char *)&dirent, sizeof(dirent)) == -1) {
-		perror("Unable to write root dirent on device ");
+/*
+ * Build the block of a directory. Packed images get fixed size entries,
+ * others are laid out like the kernel does it, through the same code.
+ */
+static unsigned int pack_dirblock(struct packer *p, char *block,
+		struct testfs_dir_entry *de, unsigned int n)
+{
+	unsigned int bs = p->sb->s_blocksize;
+	unsigned int i;
+
+	if (p->packed) {
+		memcpy(block, de, n*sizeof(*de));
+		return n*sizeof(*de);
+	}
+	testfs_init_dirblock(block, bs, de[0].inode, de[1].inode);
+	for (i = TESTFS_PACKED_FIRST_DIRENT; i < n; i++) {
+		if (testfs_add_dirent(block, bs, de[i].name, de[i].name_len,
+					de[i].inode, de[i].file_type)) {
+			fprintf(stderr, "Unable to add %.*s to directory %u\n",
+					de[i].name_len, de[i].name, de[0].inode);
+			exit(-1);
+		}
+	}
+	return bs;
+}
+
+/*
+ * Pack the directory at path, which gets inode ino, and everything below
+ * it. The entries of a directory get consecutive inode numbers in name
+ * order, so the files of a directory are next to each other on disk.
+ */
+static void pack_dir(struct packer *p, const char *path, struct stat *st,
+		unsigned int ino, unsigned int parent)
+{
+	unsigned int bs = p->sb->s_blocksize;
+	unsigned int max_entries = bs/sizeof(struct testfs_dir_entry);
+	unsigned int used = calc_reclen_from_len(1) + calc_reclen_from_len(2);
+	struct testfs_dir_entry *de;
+	struct pack_entry *ents = NULL;
+	unsigned int n = 0, i, subdirs = 0, size;
+	char child[PATH_MAX];
+	struct dirent *d;
+	DIR *dir;
+
+	dir = opendir(path);
+	if (!dir) {
+		perror(path);
+		exit(-1);
+	}
+	while ((d = readdir(dir)) != NULL) {
+		size_t len = strlen(d->d_name);
+		if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+			continue;
+		if (len > TESTFS_MAX_NAME_LEN) {
+			fprintf(stderr, "%s/%s : name longer than %d characters\n",
+					path, d->d_name, TESTFS_MAX_NAME_LEN);
+			exit(-1);
+		}
+		used += calc_reclen_from_len(len);
+		if (p->packed ? n + TESTFS_PACKED_FIRST_DIRENT >= max_entries : used > bs) {
+			fprintf(stderr, "%s : too many entries to fit in a directory block\n", path);
+			exit(-1);
+		}
+		ents = realloc(ents, (n + 1)*sizeof(*ents));
+		if (!ents) {
+			fprintf(stderr, "Unable to allocate memory\n");
+			exit(-1);
+		}
+		memcpy(ents[n].name, d->d_name, len + 1);
+		ents[n].len = len;
+		snprintf(child, sizeof(child), "%s/%s", path, d->d_name);
+		if (lstat(child, &ents[n].st) == -1) {
+			perror(child);
+			exit(-1);
+		}
+		n++;
+	}
+	closedir(dir);
+	qsort(ents, n, sizeof(*ents), pack_entry_cmp);
+	if (p->next_ino + n > p->sb->s_max_inodes) {
+		fprintf(stderr, "Too many files, the device has room for %u\n",
+				p->sb->s_max_inodes - p->sb->s_first_nonmeta_inode - 1);
 		exit(-1);
 	}
-	testfs_debug("Root inode = %u\n",dirent.inode);
 
-	/*
-	 * Create the inode for root inode
-	 */
-	inode.uid = inode.gid = 0;
-	inode.size = sb.s_blocksize;
-	inode.type = S_IFDIR|0755;
-	inode.nlinks = 2;
-	inode.data[0] = dirent.inode;
-	time(&tm);
-	inode.atime.tv_sec = inode.mtime.tv_sec = inode.ctime.tv_sec = tm;
-	off = 3*sb.s_blocksize + sizeof(struct testfs_inode)* (dirent.inode - sb.s_first_nonmeta_inode);
-	/*
-	 * Clear the block. Doesn't matter even if it fails
-	 */
-	off = lseek(fd, off, SEEK_SET); /* First inode block */
-	write(fd, buf, sb.s_blocksize); 
-	off = lseek(fd, off, SEEK_SET); /* First inode block */
-	if (off==-1) {
-		perror("Unable to create root inode on device ");
+	de = calloc(n + TESTFS_PACKED_FIRST_DIRENT, sizeof(*de));
+	p->jobs[ino].dirblock = calloc(1, bs);
+	if (!de || !p->jobs[ino].dirblock) {
+		fprintf(stderr, "Unable to allocate memory\n");
 		exit(-1);
 	}
-	if (write(fd, (char *)&inode, sizeof(inode)) == -1) {
-		perror("Unable to write root inode on device ");
+	fill_dirent(&de[0], ".", 1, ino, st);
+	fill_dirent(&de[1], "..", 2, parent, st);
+	for (i = 0; i < n; i++) {
+		ents[i].ino = p->next_ino++;
+		fill_dirent(&de[i + TESTFS_PACKED_FIRST_DIRENT], ents[i].name, ents[i].len,
+				ents[i].ino, &ents[i].st);
+		if (S_ISDIR(ents[i].st.st_mode))
+			subdirs++;
+	}
+	size = pack_dirblock(p, p->jobs[ino].dirblock, de, n + TESTFS_PACKED_FIRST_DIRENT);
+	pack_inode(p, ino, st, size, 2 + subdirs);
+	free(de);
+
+	for (i = 0; i < n; i++) {
+		if (S_ISDIR(ents[i].st.st_mode))
+			continue;
+		snprintf(child, sizeof(child), "%s/%s", path, ents[i].name);
+		pack_file(p, child, &ents[i].st, ents[i].ino);
+	}
+	for (i = 0; i < n; i++) {
+		if (!S_ISDIR(ents[i].st.st_mode))
+			continue;
+		snprintf(child, sizeof(child), "%s/%s", path, ents[i].name);
+		pack_dir(p, child, &ents[i].st, ents[i].ino, ino);
+	}
+	free(ents);
+}
+
+/*
+ * Read the source of a file or symlink into its block
+ */
+static void read_source(struct pack_job *job, char *buf, unsigned int bs)
+{
+	ssize_t len;
+	int fd;
+
+	if (job->symlink) {
+		len = readlink(job->path, buf, bs);
+		if (len == -1) {
+			perror(job->path);
+			exit(-1);
+		}
+		if (len + 1 != job->size) {
+			fprintf(stderr, "%s : changed while being copied\n", job->path);
+			exit(-1);
+		}
+		return;
+	}
+	fd = open(job->path, O_RDONLY);
+	if (fd == -1 || (len = read(fd, buf, job->size)) == -1) {
+		perror(job->path);
 		exit(-1);
 	}
-	return;
+	if (len != job->size) {
+		fprintf(stderr, "%s : changed while being copied\n", job->path);
+		exit(-1);
+	}
+	close(fd);
 }
 
 /*
- * Update the inode and block bitmaps required for initial FS creation.
- * Since inode and block have 1:1 correspondence they reside in the same block#2
+ * Writer thread. Takes chunks of consecutive inodes, fills in their blocks
+ * and writes each chunk to the image with a single write.
  */
-static void update_bitmaps(struct testfs_super_block sb, int fd)
+static void *pack_writer(void *arg)
 {
-	char buf[sb.s_blocksize];
-	char *c;
-	int off;
-	memset(buf, 0, sb.s_blocksize);
+	struct packer *p = arg;
+	unsigned int bs = p->sb->s_blocksize;
+	size_t len = (size_t)p->chunk_blocks*bs;
+	char *data, *meta;
+	unsigned int chunk, first, last, ino;
+
+	if (posix_memalign((void **)&data, bs, len) ||
+			posix_memalign((void **)&meta, bs, len)) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		exit(-1);
+	}
+	while ((chunk = __sync_fetch_and_add(&p->next_chunk, 1)) < p->nr_chunks) {
+		first = TESTFS_ROOT_INODE(p->sb) + chunk*p->chunk_blocks;
+		last = MIN(first + p->chunk_blocks, p->next_ino);
+		len = (size_t)(last - first)*bs;
+		memset(data, 0, len);
+		memset(meta, 0, len);
+		for (ino = first; ino < last; ino++) {
+			struct pack_job *job = &p->jobs[ino];
+			size_t off = (size_t)(ino - first)*bs;
+
+			if (job->dirblock)
+				memcpy((p->metafd != p->fd ? meta : data) + off, job->dirblock, bs);
+			else
+				read_source(job, data + off, bs);
+		}
+		write_at(p->fd, data, len, (off_t)get_block_from_inode(first)*bs,
+				"Unable to write image ");
+		/* Directory blocks have the same block numbers on metadev */
+		if (p->metafd != p->fd)
+			write_at(p->metafd, meta, len, (off_t)get_block_from_inode(first)*bs,
+					"Unable to write directory blocks ");
+	}
+	free(data);
+	free(meta);
+	return NULL;
+}
+
+/*
+ * Copy the tree at srcdir into the image. Packed images (-p) are read-only,
+ * others (-d) are ordinary filesystems which can be mounted read-write.
+ * The tree is walked first to give out the inodes and build the directory
+ * blocks and the inode table, then threads read the files and write the
+ * blocks out in large chunks. Replaces create_root_dir().
+ */
+static void pack_tree(struct meta_image *mi, int fd, int metafd, char *srcdir,
+		int packed, unsigned int threads)
+{
+	struct testfs_super_block *sb = mi->sb;
+	unsigned int root = TESTFS_ROOT_INODE(sb);
+	pthread_t tids[threads];
+	struct packer p;
+	struct stat st;
+	unsigned int i;
+
+	if (stat(srcdir, &st) == -1 || !S_ISDIR(st.st_mode)) {
+		fprintf(stderr, "%s : not a directory\n", srcdir);
+		exit(-1);
+	}
+
+	memset(&p, 0, sizeof(p));
+	p.sb = sb;
+	p.fd = fd;
+	p.metafd = metafd;
+	p.mi = mi;
+	p.packed = packed;
+	p.next_ino = root + 1;
+	p.jobs = calloc(sb->s_max_inodes, sizeof(*p.jobs));
+	if (!p.jobs) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		exit(-1);
+	}
+	pack_dir(&p, srcdir, &st, root, root);
+
+	p.chunk_blocks = PACK_CHUNK_BYTES/sb->s_blocksize;
+	p.nr_chunks = (p.next_ino - root + p.chunk_blocks - 1)/p.chunk_blocks;
+	threads = MIN(threads, p.nr_chunks);
+	for (i = 1; i < threads; i++) {
+		if (pthread_create(&tids[i], NULL, pack_writer, &p)) {
+			fprintf(stderr, "Unable to start writer threads\n");
+			exit(-1);
+		}
+	}
+	pack_writer(&p);
+	for (i = 1; i < threads; i++)
+		pthread_join(tids[i], NULL);
+
+	for (i = root; i < p.next_ino; i++) {
+		free(p.jobs[i].path);
+		free(p.jobs[i].dirblock);
+	}
+	free(p.jobs);
+	update_bitmaps(mi);
+	sb->s_free_inodes = sb->s_max_inodes - (p.next_ino - root);
+	printf("%s %u inodes from %s\n", packed ? "Packed" : "Copied", p.next_ino - root, srcdir);
+}
 
-	/* Mark blocks 0-6 in use. Block 0 will never be used */
-	c = buf;
-	*c = 0x7f;  /* 01111111 */
-	off = lseek(fd, 2*sb.s_blocksize, SEEK_SET); /* bitmap block */
+/*
+ * Returns the size of the device in blocks
+ */
+static off_t device_blocks(int fd, unsigned int blocksize)
+{
+	off_t off = lseek(fd, 0, SEEK_END);
 	if (off==-1) {
-		perror("Unable to lseek to bitmap block on device ");
+		perror("Error lseeking device ");
 		exit(-1);
 	}
-	if (write(fd, (char *)buf, sb.s_blocksize) == -1) {
-		perror("Unable to write bitmap on device ");
+	if (off/blocksize < TESTFS_MIN_BLOCKS) {
+		fprintf(stderr, "Too small device file. Atleast %uKB is needed\n",
+				TESTFS_MIN_BLOCKS*blocksize/1024);
 		exit(-1);
 	}
-	return;
+	return off/blocksize;
+}
+
+/*
+ * Tell the device that all of its blocks are unused, so that a thin
+ * provisioned or flash device starts out empty. Image files get their
+ * blocks punched out instead. Not being able to discard is not fatal.
+ */
+static void discard_device(int fd, const char *name)
+{
+	struct stat st;
+	__u64 range[2];
+
+	if (fstat(fd, &st) == -1) {
+		perror(name);
+		return;
+	}
+	range[0] = 0;
+	range[1] = lseek(fd, 0, SEEK_END);
+	if (S_ISBLK(st.st_mode)) {
+		if (ioctl(fd, BLKDISCARD, &range) == -1)
+			fprintf(stderr, "%s : discard failed (%s), continuing\n", name, strerror(errno));
+	} else if (fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, 0, range[1]) == -1) {
+		fprintf(stderr, "%s : unable to punch out blocks (%s), continuing\n",
+				name, strerror(errno));
+	}
+}
+
+/*
+ * Options given on the command line
+ */
+struct mkfs_opts {
+	unsigned int blocksize;
+	unsigned long inode_ratio;	/* Bytes per inode, 0 for the default table size */
+	unsigned long inodes;		/* Inodes wanted, overrides inode_ratio */
+	char *label;
+	char *metadev;
+	char *srcdir;
+	int packed;			/* srcdir came with -p, not -d */
+	unsigned int threads;
+	int discard;
+	int zero_itable;
+};
+
+/*
+ * Size the inode table for the number of inodes asked for. The table has
+ * to end before the data blocks it describes and the bitmap has to be
+ * able to map all of them, which puts an upper limit on it. -N may ask
+ * for more inodes than the device has blocks, the table then has room
+ * for testfs-resize to grow the filesystem into once the device grows.
+ */
+static unsigned int itable_blocks(struct mkfs_opts *o, off_t blocks)
+{
+	unsigned int ipb = o->blocksize/sizeof(struct testfs_inode);
+	unsigned long inodes = o->inodes;
+	unsigned long max = o->blocksize*8UL;
+	unsigned long n;
+
+	if (!inodes && !o->inode_ratio)
+		return TESTFS_INODE_TABLE_BLOCKS;
+	if (!inodes)
+		inodes = MIN((unsigned long long)blocks*o->blocksize/o->inode_ratio,
+				(unsigned long)blocks);
+	inodes = MIN(inodes, max);
+	n = (inodes + ipb - 1)/ipb;
+	if (n*ipb > max)
+		n = max/ipb;
+	if (!n)
+		n = 1;
+	/* Keep at least a few blocks for files */
+	if (TESTFS_INODE_TABLE_BLOCK + n + 2 > blocks) {
+		fprintf(stderr, "No room for an inode table of %lu blocks\n", n);
+		exit(-1);
+	}
+	return n;
 }
 
 /*
  * Create the filesystem ie... create superblock and other
- * required stuff so as to make this device mountable as testfs
+ * required stuff so as to make this device mountable as testfs.
+ * If metadev is given the bitmap, inode table and directory blocks
+ * are put there, it gets a copy of the superblock too.
  */
-static void create_testfs(char *device)
+static void create_testfs(char *device, struct mkfs_opts *o)
 {
-	int fd;
-	off_t off;
+	int fd, metafd;
+	off_t blocks;
 	int total_inodes ;
 	int max_inode_entries;
 	struct testfs_super_block sb;
+	struct meta_image mi;
 	memset(&sb, 0 , sizeof(sb));
 	fd = open(device, O_RDWR);
 	if (fd==-1) {
@@ -169,67 +662,156 @@ static void create_testfs(char *device)
 		exit(-1);
 	}
 
-	/* Get the size of the device. Should be minimum 25*4KB */
-	off = lseek(fd, 0, SEEK_END);
-	if (off==-1) {
-		perror("Error lseeking device ");
-		exit(-1);
+	/* Get the size of the device. Should be minimum 25 blocks */
+	blocks = device_blocks(fd, o->blocksize);
+	metafd = fd;
+	if (o->metadev) {
+		metafd = open(o->metadev, O_RDWR);
+		if (metafd==-1) {
+			perror("Error opening metadata device ");
+			exit(-1);
+		}
+		/* Directory blocks go to the same block numbers on metadev */
+		blocks = MIN(blocks, device_blocks(metafd, o->blocksize));
+		sb.s_features = TESTFS_FEATURE_METADEV;
+		srand(time(NULL) ^ getpid());
+		sb.s_meta_id = rand();
 	}
-	if (off/TESTFS_DFLT_BLOCKSIZE < TESTFS_MIN_BLOCKS) {
-		fprintf(stderr, "Too small device file. Atleast 100KB is needed\n");
-		exit(-1);
+	if (o->discard) {
+		discard_device(fd, device);
+		if (metafd != fd)
+			discard_device(metafd, o->metadev);
 	}
 
 	/*
 	 * Currently we have 1:1 correspondence of blocks with inode number
-	 * Total inodes only contains user usable inodes. This also means that
-	 * in a directory we can have only 4096/(size of dirent) entries.
+	 * so inode numbers go upto the number of blocks. This also means that
+	 * in a directory we can have only blocksize/(size of dirent) entries.
 	 *
-	 * An exception to this is the inode block. We reserve 3 blocks for inode
-	 * table blocknumbers 3,4 & 5. I guess that should be enough for our testfs :-)
+	 * An exception to this is the inode table which starts at block 3.
+	 * It is 3 blocks unless asked otherwise and the root directory gets
+	 * the block right after it.
 	 */
-	total_inodes = off/TESTFS_DFLT_BLOCKSIZE;
-	sb.s_blocksize = TESTFS_DFLT_BLOCKSIZE;
+	total_inodes = blocks;
+	sb.s_blocksize = o->blocksize;
 	sb.s_magic = TESTFS_MAGIC;
-	sb.s_first_nonmeta_inode = TESTFS_FIRST_NONMETA_INODE;
-	sb.s_max_inodes = total_inodes - sb.s_first_nonmeta_inode;
+	sb.s_itable_blocks = itable_blocks(o, blocks);
+	sb.s_first_nonmeta_inode = TESTFS_INODE_TABLE_BLOCK + sb.s_itable_blocks;
+	sb.s_max_inodes = total_inodes;
+	if (o->label)
+		memcpy(sb.s_label, o->label, strlen(o->label));
 
-	/* Cap the max inodes based on inode table */
-	max_inode_entries = (3*TESTFS_DFLT_BLOCKSIZE)/sizeof(struct testfs_inode);
+	/* Cap the max inodes based on inode table. Inodes don't span blocks */
+	max_inode_entries = TESTFS_MAX_INODES(o->blocksize, sb.s_itable_blocks);
 	sb.s_max_inodes = MIN(max_inode_entries, sb.s_max_inodes);
 	sb.s_free_inodes = sb.s_max_inodes - 1; /* 1 less due to root */
 	testfs_debug("Max number of inodes in filesystem = %u\n", sb.s_max_inodes);
 
-	if (off/sb.s_blocksize > sb.s_max_inodes) {
+	if (blocks > sb.s_max_inodes) {
 		fprintf(stderr, "TESTFS-warning : Too large device for (%u) inodes. Some blocks will be wasted\n", sb.s_max_inodes);
 	}
 
-	/* Write the superblock to device. 1st block is the superblock not the
-	 * zeroeth one */
-	off = lseek(fd, 4096, SEEK_SET);
-	if (off==-1) {
-		perror("Error lseeking device ");
-		exit(-1);
+	init_meta_image(&mi, &sb);
+	if (o->srcdir) {
+		if (o->packed)
+			sb.s_features |= TESTFS_FEATURE_PACKED;
+		pack_tree(&mi, fd, metafd, o->srcdir, o->packed, o->threads);
+	} else {
+		update_bitmaps(&mi);
+		create_root_dir(&mi, metafd);
 	}
-	if(write(fd, (char *)&sb, sizeof(sb)) == -1) {
-		perror("Unable to write superblock ");
+	write_meta_image(&mi, fd, metafd, o->zero_itable);
+
+	if (fsync(metafd) == -1 || (metafd != fd && fsync(fd) == -1)) {
+		perror("Unable to flush device ");
 		exit(-1);
 	}
-
-	update_bitmaps(sb, fd);
-	create_root_dir(sb, fd);
+	if (metafd != fd)
+		close(metafd);
 	close(fd);
 }
 
 int main(int argc, char **argv)
 {
-	char device[50];
+	char device[PATH_MAX];
+	struct mkfs_opts o;
+	int c;
 	progname = argv[0];
-	if (argc < 2) {
-		fprintf(stderr, "Enter the device name : ");
-		scanf("%[^\n]s",device);
-	} else
-		strcpy(device, argv[1]);
-	create_testfs(device);
+	memset(&o, 0, sizeof(o));
+	o.blocksize = TESTFS_DFLT_BLOCKSIZE;
+	o.threads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((c = getopt(argc, argv, "b:i:N:L:m:p:d:j:Dzh")) != -1) {
+		switch (c) {
+		case 'b':
+			o.blocksize = strtoul(optarg, NULL, 0);
+			if (o.blocksize < TESTFS_MIN_BLOCKSIZE || o.blocksize > TESTFS_MAX_BLOCKSIZE ||
+					(o.blocksize & (o.blocksize - 1))) {
+				fprintf(stderr, "Invalid blocksize %s\n", optarg);
+				usage();
+				exit(-1);
+			}
+			break;
+		case 'i':
+			o.inode_ratio = strtoul(optarg, NULL, 0);
+			if (!o.inode_ratio) {
+				fprintf(stderr, "Invalid bytes per inode %s\n", optarg);
+				exit(-1);
+			}
+			break;
+		case 'N':
+			o.inodes = strtoul(optarg, NULL, 0);
+			if (!o.inodes) {
+				fprintf(stderr, "Invalid number of inodes %s\n", optarg);
+				exit(-1);
+			}
+			break;
+		case 'L':
+			if (strlen(optarg) > TESTFS_LABEL_LEN) {
+				fprintf(stderr, "Label can be at most %d characters\n", TESTFS_LABEL_LEN);
+				exit(-1);
+			}
+			o.label = optarg;
+			break;
+		case 'm':
+			o.metadev = optarg;
+			break;
+		case 'p':
+		case 'd':
+			if (o.srcdir) {
+				fprintf(stderr, "Only one of -p and -d can be given\n");
+				exit(-1);
+			}
+			o.srcdir = optarg;
+			o.packed = (c == 'p');
+			break;
+		case 'j':
+			o.threads = strtoul(optarg, NULL, 0);
+			if (!o.threads || o.threads > 256) {
+				fprintf(stderr, "Invalid number of threads %s\n", optarg);
+				exit(-1);
+			}
+			break;
+		case 'D':
+			o.discard = 1;
+			break;
+		case 'z':
+			o.zero_itable = 1;
+			break;
+		default:
+			usage();
+			exit(-1);
+		}
+	}
+	if (optind < argc) {
+		create_testfs(argv[optind], &o);
+		return 0;
+	}
+	fprintf(stderr, "Enter the device name : ");
+	if (!fgets(device, sizeof(device), stdin)) {
+		usage();
+		exit(-1);
+	}
+	device[strcspn(device, "\n")] = '\0';
+	create_testfs(device, &o);
 	return 0;
 }
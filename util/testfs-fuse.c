@@ -0,0 +1,986 @@
+/***********************************************************/
+/*  Author : Manish Katiyar <mkatiyar@gmail.com>           */
+/*  Description : A simple disk based filesystem for linux */
+/*  Date   : 08/01/09                                      */
+/*  Version : 0.01                                         */
+/*  Distributed under GPL                                  */
+/***********************************************************/
+
+/*
+ * Mount a testfs image through FUSE, without the kernel module, eg.
+ *	testfs-fuse mytestfile mnt
+ *	fusermount3 -u mnt
+ * It uses the low level API of libfuse 3 with a multithreaded loop. File
+ * data is spliced between the image and the fuse device, so it is not
+ * copied through the daemon, and only the metadata operations are
+ * serialized. It supports what the module does plus mkdir and rmdir.
+ */
+#define FUSE_USE_VERSION 31
+#define _GNU_SOURCE
+#include<stdio.h>
+#include<stdlib.h>
+#include<stddef.h>
+#include<fcntl.h>
+#include<string.h>
+#include<unistd.h>
+#include<errno.h>
+#include<time.h>
+#include<pthread.h>
+#include<sys/stat.h>
+#include<sys/statvfs.h>
+#include<fuse_lowlevel.h>
+#include "libtestfs.h"
+
+#define TFUSE_TOOL "testfs-fuse"
+#define TFUSE_VERSION "1.0.0"
+
+/*
+ * State of the mounted image
+ */
+struct tfuse {
+	struct testfs_image img;
+	pthread_mutex_t lock;	/* Bitmap, inode table, directories and superblock */
+	unsigned char *bitmap;
+	unsigned long *nlookup;	/* References the kernel holds to every inode */
+	unsigned int root;
+	unsigned int next_generation;
+	double timeout;		/* How long the kernel may cache entries and attributes */
+	int ro;
+};
+
+static struct tfuse tf;
+
+/*
+ * Command line options besides the generic fuse ones
+ */
+struct tfuse_opts {
+	char *image;
+	char *metadev;
+	double timeout;
+	int ro;
+};
+
+enum {
+	KEY_RO,
+};
+
+#define TFUSE_OPT(t, p) { t, offsetof(struct tfuse_opts, p), 1 }
+static const struct fuse_opt tfuse_opt_spec[] = {
+	TFUSE_OPT("metadev=%s", metadev),
+	TFUSE_OPT("timeout=%lf", timeout),
+	FUSE_OPT_KEY("ro", KEY_RO),
+	FUSE_OPT_END
+};
+
+static void usage(const char *progname)
+{
+	fprintf(stderr,"%s (version %s) - Mount a testfs image with FUSE\n",
+			TFUSE_TOOL, TFUSE_VERSION);
+	fprintf(stderr,"Usage : %s [options] image mountpoint\n", progname);
+	fprintf(stderr,"\t-o metadev=dev : Metadata device of images made with mktestfs -m\n");
+	fprintf(stderr,"\t-o timeout=secs : Time the kernel caches entries and attributes (default 1)\n");
+	fprintf(stderr,"\t-o ro : Mount read-only, packed images always are\n");
+}
+
+/*
+ * The root is FUSE_ROOT_ID to the kernel, every other inode keeps its number
+ */
+static inline unsigned int tfuse_ino(fuse_ino_t ino)
+{
+	return ino == FUSE_ROOT_ID ? tf.root : ino;
+}
+
+static inline fuse_ino_t fuse_ino(unsigned int ino)
+{
+	return ino == tf.root ? FUSE_ROOT_ID : ino;
+}
+
+static void now(struct testfs_timestamp *ts)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_REALTIME, &t);
+	ts->tv_sec = t.tv_sec;
+	ts->tv_nsec = t.tv_nsec;
+}
+
+static inline int inode_in_use(unsigned int ino)
+{
+	return ino >= tf.root && ino < tf.img.sb.s_max_inodes &&
+		(tf.bitmap[ino/8] & (1 << (ino%8)));
+}
+
+/*
+ * Called with tf.lock held, like the rest of the metadata helpers
+ */
+static int read_inode(unsigned int ino, struct testfs_inode *raw)
+{
+	if (!inode_in_use(ino))
+		return -ENOENT;
+	return testfs_image_read_inode(&tf.img, ino, raw);
+}
+
+static int read_dir(unsigned int ino, struct testfs_inode *raw, char *block)
+{
+	int err = read_inode(ino, raw);
+	if (err)
+		return err;
+	if (!S_ISDIR(raw->type))
+		return -ENOTDIR;
+	return testfs_image_read(&tf.img, 1, raw->data[0], block);
+}
+
+static int write_bitmap(void)
+{
+	return testfs_image_write(&tf.img, 1, TESTFS_INODE_BM_BLOCK, tf.bitmap);
+}
+
+static int alloc_inode(unsigned int *ino)
+{
+	unsigned int scanned;
+
+	*ino = testfs_find_free_bit(tf.bitmap, NULL, tf.root, tf.img.sb.s_max_inodes, &scanned);
+	if (!*ino)
+		return -ENOSPC;
+	tf.bitmap[*ino/8] |= 1 << (*ino%8);
+	tf.img.sb.s_free_inodes--;
+	return write_bitmap();
+}
+
+static void free_inode(unsigned int ino)
+{
+	tf.bitmap[ino/8] &= ~(1 << (ino%8));
+	tf.img.sb.s_free_inodes++;
+	write_bitmap();
+}
+
+/*
+ * Inodes which are unlinked while the kernel still knows them are put on
+ * the orphan list like the module does, so that they are freed at the
+ * next mount (or by fsck) if we go away before the kernel forgets them.
+ */
+static int orphan_add(unsigned int ino, struct testfs_inode *raw)
+{
+	int err;
+
+	/* The inode must be on disk before the superblock points at it */
+	raw->next_orphan = tf.img.sb.s_last_orphan;
+	err = testfs_image_write_inode(&tf.img, ino, raw);
+	if (!err && fdatasync(tf.img.metafd))
+		err = -errno;
+	if (err)
+		return err;
+	tf.img.sb.s_last_orphan = ino;
+	return testfs_image_write_super(&tf.img);
+}
+
+static void orphan_del(unsigned int ino, struct testfs_inode *raw)
+{
+	struct testfs_inode prev;
+	unsigned int cur = tf.img.sb.s_last_orphan, n;
+
+	if (cur == ino) {
+		tf.img.sb.s_last_orphan = raw->next_orphan;
+		testfs_image_write_super(&tf.img);
+		return;
+	}
+	for (n = 0; cur && n < tf.img.sb.s_max_inodes; n++) {
+		if (testfs_image_read_inode(&tf.img, cur, &prev))
+			return;
+		if (prev.next_orphan == ino) {
+			prev.next_orphan = raw->next_orphan;
+			testfs_image_write_inode(&tf.img, cur, &prev);
+			return;
+		}
+		cur = prev.next_orphan;
+	}
+}
+
+/*
+ * Free everything on the orphan list, at mount and unmount
+ */
+static void release_orphans(void)
+{
+	struct testfs_inode raw;
+	unsigned int ino = tf.img.sb.s_last_orphan, n;
+
+	for (n = 0; ino && n < tf.img.sb.s_max_inodes; n++) {
+		if (!inode_in_use(ino) || testfs_image_read_inode(&tf.img, ino, &raw))
+			break;
+		free_inode(ino);
+		ino = raw.next_orphan;
+	}
+	tf.img.sb.s_last_orphan = 0;
+	testfs_image_write_super(&tf.img);
+}
+
+static void fill_stat(unsigned int ino, struct testfs_inode *raw, struct stat *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->st_ino = ino;
+	st->st_mode = raw->type;
+	st->st_nlink = raw->nlinks;
+	st->st_uid = raw->uid;
+	st->st_gid = raw->gid;
+	st->st_size = raw->size;
+	st->st_blksize = tf.img.blocksize;
+	st->st_blocks = tf.img.blocksize/512;
+	st->st_atim.tv_sec = raw->atime.tv_sec;
+	st->st_atim.tv_nsec = raw->atime.tv_nsec;
+	st->st_mtim.tv_sec = raw->mtime.tv_sec;
+	st->st_mtim.tv_nsec = raw->mtime.tv_nsec;
+	st->st_ctim.tv_sec = raw->ctime.tv_sec;
+	st->st_ctim.tv_nsec = raw->ctime.tv_nsec;
+}
+
+/*
+ * Entry for ino, which the kernel is going to hold a reference to
+ */
+static void fill_entry(unsigned int ino, struct testfs_inode *raw, struct fuse_entry_param *e)
+{
+	memset(e, 0, sizeof(*e));
+	e->ino = fuse_ino(ino);
+	e->generation = raw->generation;
+	fill_stat(ino, raw, &e->attr);
+	e->attr_timeout = tf.timeout;
+	e->entry_timeout = tf.timeout;
+	if (ino != tf.root)
+		tf.nlookup[ino]++;
+}
+
+static void tfuse_init(void *userdata, struct fuse_conn_info *conn)
+{
+	/* File data goes between the image and /dev/fuse with splice */
+	if (conn->capable & FUSE_CAP_SPLICE_WRITE)
+		conn->want |= FUSE_CAP_SPLICE_WRITE;
+	if (conn->capable & FUSE_CAP_SPLICE_MOVE)
+		conn->want |= FUSE_CAP_SPLICE_MOVE;
+	if (conn->capable & FUSE_CAP_SPLICE_READ)
+		conn->want |= FUSE_CAP_SPLICE_READ;
+}
+
+static void tfuse_destroy(void *userdata)
+{
+	pthread_mutex_lock(&tf.lock);
+	if (!tf.ro) {
+		release_orphans();
+		testfs_image_write_super(&tf.img);
+		fsync(tf.img.fd);
+		fsync(tf.img.metafd);
+	}
+	pthread_mutex_unlock(&tf.lock);
+}
+
+static void tfuse_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct testfs_inode raw;
+	struct testfs_dir_entry *de;
+	struct fuse_entry_param e;
+	unsigned int len = strlen(name), scanned = 0;
+	char block[tf.img.blocksize];
+	int err;
+
+	if (len > TESTFS_MAX_NAME_LEN) {
+		fuse_reply_err(req, ENAMETOOLONG);
+		return;
+	}
+	pthread_mutex_lock(&tf.lock);
+	err = read_dir(tfuse_ino(parent), &raw, block);
+	if (!err)
+		err = testfs_search_dirents(block, block + raw.size, name, len, &de, &scanned);
+	if (!err)
+		err = read_inode(de->inode, &raw);
+	if (!err)
+		fill_entry(de->inode, &raw, &e);
+	pthread_mutex_unlock(&tf.lock);
+
+	if (err == -ENOENT) {
+		/* Let the kernel cache the miss as well */
+		memset(&e, 0, sizeof(e));
+		e.entry_timeout = tf.timeout;
+		fuse_reply_entry(req, &e);
+	} else if (err)
+		fuse_reply_err(req, -err);
+	else
+		fuse_reply_entry(req, &e);
+}
+
+/*
+ * Drop references of the kernel. An unlinked inode is freed with the
+ * last one.
+ */
+static void forget_one(fuse_ino_t fino, uint64_t nlookup)
+{
+	unsigned int ino = tfuse_ino(fino);
+	struct testfs_inode raw;
+
+	if (ino == tf.root || ino >= tf.img.sb.s_max_inodes)
+		return;
+	pthread_mutex_lock(&tf.lock);
+	tf.nlookup[ino] -= nlookup < tf.nlookup[ino] ? nlookup : tf.nlookup[ino];
+	if (!tf.nlookup[ino] && !read_inode(ino, &raw) && !raw.nlinks) {
+		orphan_del(ino, &raw);
+		free_inode(ino);
+	}
+	pthread_mutex_unlock(&tf.lock);
+}
+
+static void tfuse_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+	forget_one(ino, nlookup);
+	fuse_reply_none(req);
+}
+
+static void tfuse_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		forget_one(forgets[i].ino, forgets[i].nlookup);
+	fuse_reply_none(req);
+}
+
+static void tfuse_getattr(fuse_req_t req, fuse_ino_t fino, struct fuse_file_info *fi)
+{
+	unsigned int ino = tfuse_ino(fino);
+	struct testfs_inode raw;
+	struct stat st;
+	int err;
+
+	pthread_mutex_lock(&tf.lock);
+	err = read_inode(ino, &raw);
+	pthread_mutex_unlock(&tf.lock);
+	if (err) {
+		fuse_reply_err(req, -err);
+		return;
+	}
+	fill_stat(ino, &raw, &st);
+	fuse_reply_attr(req, &st, tf.timeout);
+}
+
+static void tfuse_setattr(fuse_req_t req, fuse_ino_t fino, struct stat *attr,
+		int to_set, struct fuse_file_info *fi)
+{
+	unsigned int ino = tfuse_ino(fino);
+	unsigned int bs = tf.img.blocksize;
+	struct testfs_inode raw;
+	struct stat st;
+	int err;
+
+	if (tf.ro) {
+		fuse_reply_err(req, EROFS);
+		return;
+	}
+	pthread_mutex_lock(&tf.lock);
+	err = read_inode(ino, &raw);
+	if (err)
+		goto out;
+	if (to_set & FUSE_SET_ATTR_SIZE) {
+		err = -EINVAL;
+		if (!S_ISREG(raw.type))
+			goto out;
+		err = -EFBIG;
+		if (attr->st_size > bs)
+			goto out;
+		/* Whatever was past the new size must read back as zeroes */
+		if (attr->st_size < raw.size) {
+			char zero[bs];
+			memset(zero, 0, bs);
+			if (pwrite(tf.img.fd, zero, raw.size - attr->st_size,
+					(off_t)raw.data[0]*bs + attr->st_size) == -1) {
+				err = -errno;
+				goto out;
+			}
+		}
+		raw.size = attr->st_size;
+		now(&raw.mtime);
+	}
+	if (to_set & FUSE_SET_ATTR_MODE)
+		raw.type = (raw.type & S_IFMT) | (attr->st_mode & 07777);
+	if (to_set & FUSE_SET_ATTR_UID)
+		raw.uid = attr->st_uid;
+	if (to_set & FUSE_SET_ATTR_GID)
+		raw.gid = attr->st_gid;
+	if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+		now(&raw.atime);
+	else if (to_set & FUSE_SET_ATTR_ATIME) {
+		raw.atime.tv_sec = attr->st_atim.tv_sec;
+		raw.atime.tv_nsec = attr->st_atim.tv_nsec;
+	}
+	if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+		now(&raw.mtime);
+	else if (to_set & FUSE_SET_ATTR_MTIME) {
+		raw.mtime.tv_sec = attr->st_mtim.tv_sec;
+		raw.mtime.tv_nsec = attr->st_mtim.tv_nsec;
+	}
+	now(&raw.ctime);
+	err = testfs_image_write_inode(&tf.img, ino, &raw);
+out:
+	pthread_mutex_unlock(&tf.lock);
+	if (err) {
+		fuse_reply_err(req, -err);
+		return;
+	}
+	fill_stat(ino, &raw, &st);
+	fuse_reply_attr(req, &st, tf.timeout);
+}
+
+/*
+ * Create name in parent. target is the target of a symlink.
+ */
+static int new_entry(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+		const char *target, struct fuse_entry_param *e)
+{
+	const struct fuse_ctx *ctx = fuse_req_ctx(req);
+	unsigned int bs = tf.img.blocksize;
+	unsigned int dir = tfuse_ino(parent), ino = 0;
+	unsigned int len = strlen(name);
+	struct testfs_inode draw, raw;
+	char dblock[bs], block[bs];
+	int err;
+
+	if (tf.ro)
+		return -EROFS;
+	if (len > TESTFS_MAX_NAME_LEN)
+		return -ENAMETOOLONG;
+	if (target && strlen(target) >= bs)
+		return -ENAMETOOLONG;
+
+	pthread_mutex_lock(&tf.lock);
+	err = read_dir(dir, &draw, dblock);
+	if (err)
+		goto out;
+	err = alloc_inode(&ino);
+	if (err)
+		goto out;
+
+	memset(&raw, 0, sizeof(raw));
+	memset(block, 0, bs);
+	raw.uid = ctx->uid;
+	raw.gid = ctx->gid;
+	raw.type = mode;
+	raw.nlinks = 1;
+	raw.data[0] = ino;
+	raw.generation = tf.next_generation++;
+	now(&raw.ctime);
+	raw.atime = raw.mtime = raw.ctime;
+	if (S_ISDIR(mode)) {
+		testfs_init_dirblock(block, bs, ino, dir);
+		raw.size = bs;
+		raw.nlinks = 2;
+	} else if (target) {
+		/* The kernel keeps the terminating NUL as part of the link */
+		raw.size = strlen(target) + 1;
+		memcpy(block, target, raw.size);
+	}
+	err = testfs_add_dirent(dblock, bs, name, len, ino,
+			S_ISDIR(mode) ? S_IFDIR : S_ISREG(mode) ? S_IFREG : 0);
+	if (err)
+		goto out_free;
+	err = testfs_image_write(&tf.img, S_ISDIR(mode), ino, block);
+	if (!err)
+		err = testfs_image_write_inode(&tf.img, ino, &raw);
+	if (err)
+		goto out_free;
+
+	/* The new inode is complete on disk, now link it in */
+	if (S_ISDIR(mode))
+		draw.nlinks++;
+	draw.mtime = draw.ctime = raw.ctime;
+	err = testfs_image_write(&tf.img, 1, draw.data[0], dblock);
+	if (!err)
+		err = testfs_image_write_inode(&tf.img, dir, &draw);
+	if (!err)
+		fill_entry(ino, &raw, e);
+	goto out;
+out_free:
+	free_inode(ino);
+out:
+	pthread_mutex_unlock(&tf.lock);
+	return err;
+}
+
+static void tfuse_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+		mode_t mode, struct fuse_file_info *fi)
+{
+	struct fuse_entry_param e;
+	int err = new_entry(req, parent, name, S_IFREG | (mode & 07777), NULL, &e);
+
+	if (err) {
+		fuse_reply_err(req, -err);
+		return;
+	}
+	fi->keep_cache = 1;
+	fuse_reply_create(req, &e, fi);
+}
+
+static void tfuse_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+	struct fuse_entry_param e;
+	int err = new_entry(req, parent, name, S_IFDIR | (mode & 07777), NULL, &e);
+
+	if (err)
+		fuse_reply_err(req, -err);
+	else
+		fuse_reply_entry(req, &e);
+}
+
+static void tfuse_symlink(fuse_req_t req, const char *link, fuse_ino_t parent,
+		const char *name)
+{
+	struct fuse_entry_param e;
+	int err = new_entry(req, parent, name, S_IFLNK | 0777, link, &e);
+
+	if (err)
+		fuse_reply_err(req, -err);
+	else
+		fuse_reply_entry(req, &e);
+}
+
+static int dir_is_empty(char *block, unsigned int size)
+{
+	struct testfs_dir_entry *de = (struct testfs_dir_entry *)block;
+	unsigned int n = 0;
+
+	for (; (char *)de < block + size && de->rec_len;
+			de = (struct testfs_dir_entry *)((char *)de + de->rec_len))
+		if (de->inode && ++n > TESTFS_PACKED_FIRST_DIRENT)
+			return 0;
+	return 1;
+}
+
+/*
+ * Remove name from parent, a directory if isdir is set
+ */
+static int remove_entry(fuse_ino_t parent, const char *name, int isdir)
+{
+	unsigned int bs = tf.img.blocksize;
+	unsigned int dir = tfuse_ino(parent), ino, scanned = 0;
+	unsigned int len = strlen(name);
+	struct testfs_inode draw, raw;
+	struct testfs_dir_entry *de;
+	char dblock[bs], block[bs];
+	int err;
+
+	if (tf.ro)
+		return -EROFS;
+	pthread_mutex_lock(&tf.lock);
+	err = read_dir(dir, &draw, dblock);
+	if (!err)
+		err = testfs_search_dirents(dblock, dblock + draw.size, name, len, &de, &scanned);
+	if (err)
+		goto out;
+	ino = de->inode;
+	err = read_inode(ino, &raw);
+	if (err)
+		goto out;
+	if (isdir) {
+		err = -ENOTDIR;
+		if (!S_ISDIR(raw.type))
+			goto out;
+		err = testfs_image_read(&tf.img, 1, raw.data[0], block);
+		if (err)
+			goto out;
+		err = -ENOTEMPTY;
+		if (!dir_is_empty(block, raw.size))
+			goto out;
+	} else if (S_ISDIR(raw.type)) {
+		err = -EISDIR;
+		goto out;
+	}
+
+	testfs_remove_dirent(dblock, bs, name, len);
+	if (isdir)
+		draw.nlinks--;
+	now(&draw.mtime);
+	draw.ctime = draw.mtime;
+	err = testfs_image_write(&tf.img, 1, draw.data[0], dblock);
+	if (!err)
+		err = testfs_image_write_inode(&tf.img, dir, &draw);
+	if (err)
+		goto out;
+
+	raw.nlinks = isdir ? 0 : raw.nlinks - 1;
+	raw.ctime = draw.ctime;
+	if (!raw.nlinks) {
+		/* Still known to the kernel, free it when it forgets the inode */
+		if (tf.nlookup[ino]) {
+			err = orphan_add(ino, &raw);
+			goto out;
+		}
+		free_inode(ino);
+	}
+	err = testfs_image_write_inode(&tf.img, ino, &raw);
+out:
+	pthread_mutex_unlock(&tf.lock);
+	return err;
+}
+
+static void tfuse_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	fuse_reply_err(req, -remove_entry(parent, name, 0));
+}
+
+static void tfuse_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	fuse_reply_err(req, -remove_entry(parent, name, 1));
+}
+
+static void tfuse_readlink(fuse_req_t req, fuse_ino_t fino)
+{
+	unsigned int bs = tf.img.blocksize;
+	struct testfs_inode raw;
+	char block[bs];
+	int err;
+
+	pthread_mutex_lock(&tf.lock);
+	err = read_inode(tfuse_ino(fino), &raw);
+	if (!err && !S_ISLNK(raw.type))
+		err = -EINVAL;
+	if (!err)
+		err = testfs_image_read(&tf.img, 0, raw.data[0], block);
+	pthread_mutex_unlock(&tf.lock);
+	if (err) {
+		fuse_reply_err(req, -err);
+		return;
+	}
+	block[bs - 1] = '\0';
+	fuse_reply_readlink(req, block);
+}
+
+static void tfuse_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	/* Directories only change through us, the kernel may keep what it read */
+	fi->cache_readdir = 1;
+	fuse_reply_open(req, fi);
+}
+
+/*
+ * The offset of an entry is the byte offset of the one after it in the
+ * directory block, like f_pos of the module's readdir.
+ */
+static void tfuse_readdir(fuse_req_t req, fuse_ino_t fino, size_t size, off_t off,
+		struct fuse_file_info *fi)
+{
+	unsigned int bs = tf.img.blocksize;
+	struct testfs_inode raw;
+	struct testfs_dir_entry *de;
+	char block[bs], name[TESTFS_MAX_NAME_LEN + 1];
+	char *buf, *pos;
+	size_t used = 0;
+	struct stat st;
+	int err;
+
+	pthread_mutex_lock(&tf.lock);
+	err = read_dir(tfuse_ino(fino), &raw, block);
+	pthread_mutex_unlock(&tf.lock);
+	if (err) {
+		fuse_reply_err(req, -err);
+		return;
+	}
+	buf = malloc(size);
+	if (!buf) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	memset(&st, 0, sizeof(st));
+	for (pos = block; pos < block + raw.size; pos += de->rec_len) {
+		size_t ent;
+		de = (struct testfs_dir_entry *)pos;
+		if (!de->rec_len)
+			break;
+		if (pos - block < off || !de->inode)
+			continue;
+		memcpy(name, de->name, de->name_len);
+		name[de->name_len] = '\0';
+		st.st_ino = de->inode;
+		st.st_mode = de->file_type;
+		ent = fuse_add_direntry(req, buf + used, size - used, name, &st,
+				pos - block + de->rec_len);
+		if (ent > size - used)
+			break;
+		used += ent;
+	}
+	fuse_reply_buf(req, buf, used);
+	free(buf);
+}
+
+static void tfuse_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	if (tf.ro && (fi->flags & O_ACCMODE) != O_RDONLY) {
+		fuse_reply_err(req, EROFS);
+		return;
+	}
+	/* All writes go through us, so the page cache stays valid across opens */
+	fi->keep_cache = 1;
+	fuse_reply_open(req, fi);
+}
+
+/*
+ * File data is spliced straight from the block of the file in the image
+ */
+static void tfuse_read(fuse_req_t req, fuse_ino_t fino, size_t size, off_t off,
+		struct fuse_file_info *fi)
+{
+	struct fuse_bufvec buf = FUSE_BUFVEC_INIT(0);
+	struct testfs_inode raw;
+	int err;
+
+	pthread_mutex_lock(&tf.lock);
+	err = read_inode(tfuse_ino(fino), &raw);
+	pthread_mutex_unlock(&tf.lock);
+	if (err) {
+		fuse_reply_err(req, -err);
+		return;
+	}
+	if (off >= raw.size) {
+		fuse_reply_buf(req, NULL, 0);
+		return;
+	}
+	buf.buf[0].size = size < raw.size - off ? size : raw.size - off;
+	buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	buf.buf[0].fd = tf.img.fd;
+	buf.buf[0].pos = (off_t)raw.data[0]*tf.img.blocksize + off;
+	fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE);
+}
+
+/*
+ * The data is spliced into the image without holding the lock, only
+ * the size and times of the inode are updated under it
+ */
+static void tfuse_write_buf(fuse_req_t req, fuse_ino_t fino, struct fuse_bufvec *in_buf,
+		off_t off, struct fuse_file_info *fi)
+{
+	unsigned int ino = tfuse_ino(fino);
+	unsigned int bs = tf.img.blocksize;
+	struct fuse_bufvec out_buf = FUSE_BUFVEC_INIT(fuse_buf_size(in_buf));
+	struct testfs_inode raw;
+	ssize_t res;
+	int err;
+
+	if (tf.ro) {
+		fuse_reply_err(req, EROFS);
+		return;
+	}
+	/* A file can't grow beyond its block */
+	if (off >= bs) {
+		fuse_reply_err(req, ENOSPC);
+		return;
+	}
+	if (out_buf.buf[0].size > bs - off)
+		out_buf.buf[0].size = bs - off;
+
+	pthread_mutex_lock(&tf.lock);
+	err = read_inode(ino, &raw);
+	pthread_mutex_unlock(&tf.lock);
+	if (err) {
+		fuse_reply_err(req, -err);
+		return;
+	}
+	out_buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	out_buf.buf[0].fd = tf.img.fd;
+	out_buf.buf[0].pos = (off_t)raw.data[0]*bs + off;
+	res = fuse_buf_copy(&out_buf, in_buf, 0);
+	if (res < 0) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+
+	pthread_mutex_lock(&tf.lock);
+	err = read_inode(ino, &raw);
+	if (!err) {
+		if (off + res > raw.size)
+			raw.size = off + res;
+		now(&raw.mtime);
+		raw.ctime = raw.mtime;
+		err = testfs_image_write_inode(&tf.img, ino, &raw);
+	}
+	pthread_mutex_unlock(&tf.lock);
+	if (err)
+		fuse_reply_err(req, -err);
+	else
+		fuse_reply_write(req, res);
+}
+
+static void tfuse_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+		struct fuse_file_info *fi)
+{
+	int err = 0;
+
+	if (!tf.ro) {
+		pthread_mutex_lock(&tf.lock);
+		testfs_image_write_super(&tf.img);
+		pthread_mutex_unlock(&tf.lock);
+		if (fdatasync(tf.img.fd) == -1 ||
+				(tf.img.metafd != tf.img.fd && fdatasync(tf.img.metafd) == -1))
+			err = errno;
+	}
+	fuse_reply_err(req, err);
+}
+
+static void tfuse_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	struct statvfs st;
+
+	memset(&st, 0, sizeof(st));
+	pthread_mutex_lock(&tf.lock);
+	st.f_bsize = st.f_frsize = tf.img.blocksize;
+	st.f_blocks = tf.img.sb.s_max_inodes;
+	st.f_bfree = st.f_bavail = tf.img.sb.s_free_inodes;
+	st.f_files = tf.img.sb.s_max_inodes - tf.root;
+	st.f_ffree = st.f_favail = tf.img.sb.s_free_inodes;
+	pthread_mutex_unlock(&tf.lock);
+	st.f_namemax = TESTFS_MAX_NAME_LEN;
+	fuse_reply_statfs(req, &st);
+}
+
+static const struct fuse_lowlevel_ops tfuse_ops = {
+	.init = tfuse_init,
+	.destroy = tfuse_destroy,
+	.lookup = tfuse_lookup,
+	.forget = tfuse_forget,
+	.forget_multi = tfuse_forget_multi,
+	.getattr = tfuse_getattr,
+	.setattr = tfuse_setattr,
+	.readlink = tfuse_readlink,
+	.mkdir = tfuse_mkdir,
+	.unlink = tfuse_unlink,
+	.rmdir = tfuse_rmdir,
+	.symlink = tfuse_symlink,
+	.open = tfuse_open,
+	.read = tfuse_read,
+	.write_buf = tfuse_write_buf,
+	.fsync = tfuse_fsync,
+	.opendir = tfuse_opendir,
+	.readdir = tfuse_readdir,
+	.fsyncdir = tfuse_fsync,
+	.statfs = tfuse_statfs,
+	.create = tfuse_create,
+};
+
+/*
+ * The first argument which isn't an option is the image, the second one
+ * is the mountpoint and is left for fuse_parse_cmdline()
+ */
+static int tfuse_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs)
+{
+	struct tfuse_opts *o = data;
+
+	switch (key) {
+	case KEY_RO:
+		o->ro = 1;
+		return 1;
+	case FUSE_OPT_KEY_NONOPT:
+		if (!o->image) {
+			o->image = strdup(arg);
+			return 0;
+		}
+		return 1;
+	}
+	return 1;
+}
+
+static int tfuse_setup(struct tfuse_opts *o, struct fuse_args *args)
+{
+	struct testfs_super_block *sb = &tf.img.sb;
+	int err;
+
+	err = testfs_image_open(&tf.img, o->image, o->metadev, O_RDWR);
+	if (err == -EROFS || err == -EACCES) {
+		o->ro = 1;
+		err = testfs_image_open(&tf.img, o->image, o->metadev, O_RDONLY);
+	}
+	if (err) {
+		fprintf(stderr, "%s : not a testfs image (%s)%s\n", o->image, strerror(-err),
+				o->metadev ? "" : ", give the metadata device with -o metadev=");
+		return -1;
+	}
+	if (sb->s_first_nonmeta_inode < TESTFS_INODE_TABLE_BLOCK + TESTFS_ITABLE_BLOCKS(sb) ||
+			sb->s_max_inodes > TESTFS_MAX_INODES(sb->s_blocksize, TESTFS_ITABLE_BLOCKS(sb)) ||
+			sb->s_max_inodes > sb->s_blocksize*8) {
+		fprintf(stderr, "%s : superblock is corrupt, run fsck.testfs\n", o->image);
+		return -1;
+	}
+	/* Packed images can't be modified, they have no room to grow */
+	if (sb->s_features & TESTFS_FEATURE_PACKED)
+		o->ro = 1;
+	if (o->ro)
+		fuse_opt_add_arg(args, "-oro");
+
+	tf.root = TESTFS_ROOT_INODE(sb);
+	tf.ro = o->ro;
+	tf.timeout = o->timeout;
+	tf.bitmap = malloc(tf.img.blocksize);
+	tf.nlookup = calloc(sb->s_max_inodes, sizeof(*tf.nlookup));
+	if (!tf.bitmap || !tf.nlookup ||
+			testfs_image_read(&tf.img, 1, TESTFS_INODE_BM_BLOCK, tf.bitmap)) {
+		fprintf(stderr, "%s : unable to read the bitmap\n", o->image);
+		return -1;
+	}
+	pthread_mutex_init(&tf.lock, NULL);
+	srand(time(NULL) ^ getpid());
+	tf.next_generation = rand();
+	if (!tf.ro && sb->s_last_orphan)
+		release_orphans();
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_cmdline_opts opts;
+	struct fuse_session *se;
+	struct tfuse_opts o;
+	int ret = 1;
+
+	memset(&o, 0, sizeof(o));
+	memset(&opts, 0, sizeof(opts));
+	o.timeout = 1.0;
+	if (fuse_opt_parse(&args, &o, tfuse_opt_spec, tfuse_opt_proc) == -1)
+		return 1;
+	if (fuse_parse_cmdline(&args, &opts) != 0)
+		goto out;
+	if (opts.show_help) {
+		usage(argv[0]);
+		fuse_cmdline_help();
+		fuse_lowlevel_help();
+		ret = 0;
+		goto out;
+	}
+	if (opts.show_version) {
+		printf("%s version %s\n", TFUSE_TOOL, TFUSE_VERSION);
+		fuse_lowlevel_version();
+		ret = 0;
+		goto out;
+	}
+	if (!o.image || !opts.mountpoint) {
+		usage(argv[0]);
+		goto out;
+	}
+	if (tfuse_setup(&o, &args))
+		goto out;
+
+	se = fuse_session_new(&args, &tfuse_ops, sizeof(tfuse_ops), NULL);
+	if (!se)
+		goto out_close;
+	if (fuse_set_signal_handlers(se) != 0)
+		goto out_destroy;
+	if (fuse_session_mount(se, opts.mountpoint) != 0)
+		goto out_signals;
+	fuse_daemonize(opts.foreground);
+	if (opts.singlethread)
+		ret = fuse_session_loop(se);
+	else
+		ret = fuse_session_loop_mt(se, opts.clone_fd);
+	fuse_session_unmount(se);
+out_signals:
+	fuse_remove_signal_handlers(se);
+out_destroy:
+	fuse_session_destroy(se);
+out_close:
+	testfs_image_close(&tf.img);
+out:
+	free(opts.mountpoint);
+	free(o.image);
+	fuse_opt_free_args(&args);
+	return ret ? 1 : 0;
+}
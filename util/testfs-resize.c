@@ -0,0 +1,82 @@
+/***********************************************************/
+/*  Author : Manish Katiyar <mkatiyar@gmail.com>           */
+/*  Description : A simple disk based filesystem for linux */
+/*  Date   : 08/01/09                                      */
+/*  Version : 0.01                                         */
+/*  Distributed under GPL                                  */
+/***********************************************************/
+
+/*
+ * Grow a mounted testfs after its device has been enlarged, eg.
+ *	truncate -s +1M mytestfile; losetup -c /dev/loop0
+ *	testfs-resize mnt
+ */
+#include<stdio.h>
+#include<stdlib.h>
+#include<fcntl.h>
+#include<string.h>
+#include<unistd.h>
+#include<errno.h>
+#include<sys/ioctl.h>
+#include "../testfs.h"
+
+#define RESIZE_TOOL "testfs-resize"
+#define RESIZE_VERSION "1.0.0"
+
+char *progname;
+
+static void usage()
+{
+	fprintf(stderr,"%s (version %s) - Grow a mounted testfs\n",
+			RESIZE_TOOL, RESIZE_VERSION);
+	fprintf(stderr,"Usage : %s [-s blocks] mountpoint\n", progname);
+	fprintf(stderr,"\t-s blocks : New size in filesystem blocks (default whole device)\n");
+	return;
+}
+
+int main(int argc, char **argv)
+{
+	__u64 blocks = 0;
+	int fd, c;
+
+	progname = argv[0];
+	while ((c = getopt(argc, argv, "s:h")) != -1) {
+		switch (c) {
+		case 's':
+			blocks = strtoull(optarg, NULL, 0);
+			if (!blocks) {
+				fprintf(stderr, "Invalid size %s\n", optarg);
+				exit(-1);
+			}
+			break;
+		default:
+			usage();
+			exit(-1);
+		}
+	}
+	if (optind >= argc) {
+		usage();
+		exit(-1);
+	}
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd == -1) {
+		perror("Unable to open mountpoint ");
+		exit(-1);
+	}
+	if (ioctl(fd, TESTFS_IOC_RESIZE_FS, &blocks) == -1) {
+		if (errno == EINVAL)
+			fprintf(stderr, "Invalid size, testfs can only grow upto the "
+					"device size and its inode table capacity\n");
+		else if (errno == ENOSPC)
+			fprintf(stderr, "The inode table is full, the filesystem can't use "
+					"more of the device. Make it with a larger mktestfs -N "
+					"to leave room to grow\n");
+		else
+			perror("Unable to resize filesystem ");
+		close(fd);
+		exit(-1);
+	}
+	close(fd);
+	return 0;
+}